@@ -12,6 +12,7 @@
 #include "freertos/queue.h"
 #include <esp_event.h>
 #include <esp_log.h>
+#include "soc/soc.h"
 
 #include <hap.h>
 #include <hap_apple_servs.h>
@@ -26,6 +27,11 @@
 #include "sprinkler.h"
 #include "homekit_states.h"
 #include "led.h"
+#include "jitter.h"
+#include "irrigation.h"
+#include "ram_budget.h"
+#include "power.h"
+#include "supervisor.h"
 
 /*  Required for server verification during OTA, PEM format as string  */
 char server_cert[] = {};
@@ -33,8 +39,14 @@ char server_cert[] = {};
 static const char *TAG = "HAP";
 
 static const uint16_t SPRINKLER_TASK_PRIORITY = 5;
-static const uint16_t SPRINKLER_TASK_STACKSIZE = 4 * 1024;
 static const char *SPRINKLER_TASK_NAME = "hap_sprinkler";
+/* HomeKit setup and networking stay on PRO_CPU, valve actuation runs on APP_CPU */
+static const BaseType_t SPRINKLER_TASK_CORE = PRO_CPU_NUM;
+
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+static StackType_t sprinkler_task_stack[SPRINKLER_TASK_STACKSIZE];
+static StaticTask_t sprinkler_task_buffer;
+#endif
 
 /* Reset network credentials if button is pressed for more than 3 seconds and then released */
 //static const uint16_t RESET_NETWORK_BUTTON_TIMEOUT = 3;
@@ -45,10 +57,23 @@ static const uint16_t RESET_TO_FACTORY_BUTTON_TIMEOUT = 10;
 /* The button "Boot" will be used as the Reset button for the example */
 static const uint16_t RESET_GPIO = GPIO_NUM_0;
 
-/* Char definitions for our switches */
-static hap_char_t *zone1_valve_inuse_char = 0;
-static hap_char_t *zone2_valve_inuse_char = 0;
-static hap_char_t *master_valve_inuse_char = 0;
+/**
+ * HomeKit state for each valve. The valve services are linked to the Irrigation System
+ * service and each carries a pointer to its entry as the service private data.
+ */
+typedef struct {
+    uint8_t valveno;
+    const char *name;
+    hap_serv_t *service;
+    hap_char_t *active_char;
+    hap_char_t *inuse_char;
+} sprinkler_valve_t;
+
+static sprinkler_valve_t valves[VALUE_COUNT] = {
+    { .valveno = VALUE_ZONE1, .name = "Zone 1 Irrigation Value" },
+    { .valveno = VALUE_ZONE2, .name = "Zone 2 Irrigation Value" },
+    { .valveno = VALUE_MASTER, .name = "Master Irrigation Value" },
+};
 static bool reset_requested = false;
 
 /**
@@ -94,11 +119,15 @@ static void sprinkler_hap_event_handler(void* arg, esp_event_base_t event_base,
     switch(event) {
         case HAP_EVENT_PAIRING_STARTED :
             ESP_LOGI(TAG, "Pairing Started");
+            jitter_set_pairing(true);
+            power_record_wakeup(POWER_WAKE_HAP_REQUEST);
             break;
         case HAP_EVENT_PAIRING_ABORTED :
             ESP_LOGI(TAG, "Pairing Aborted");
+            jitter_set_pairing(false);
             break;
         case HAP_EVENT_CTRL_PAIRED :
+            jitter_set_pairing(false);
             ESP_LOGI(TAG, "Controller %s Paired. Controller count: %d",
                         (char *)data, hap_get_paired_controller_count());
             break;
@@ -108,9 +137,19 @@ static void sprinkler_hap_event_handler(void* arg, esp_event_base_t event_base,
             break;
         case HAP_EVENT_CTRL_CONNECTED :
             ESP_LOGI(TAG, "Controller %s Connected", (char *)data);
+            /* Pair verify completed */
+            power_record_wakeup(POWER_WAKE_HAP_REQUEST);
+            supervisor_post_event(LINK_EVENT_CONTROLLER_CONNECTED);
             break;
         case HAP_EVENT_CTRL_DISCONNECTED :
             ESP_LOGI(TAG, "Controller %s Disconnected", (char *)data);
+            supervisor_post_event(LINK_EVENT_CONTROLLER_DISCONNECTED);
+            break;
+        case HAP_EVENT_GET_ACC_COMPLETED :
+        case HAP_EVENT_GET_CHAR_COMPLETED :
+        case HAP_EVENT_SET_CHAR_COMPLETED :
+            /* One per HTTP request, however many characteristics it touched */
+            power_record_wakeup(POWER_WAKE_HAP_REQUEST);
             break;
         case HAP_EVENT_ACC_REBOOTING : {
             char *reason = (char *)data;
@@ -123,121 +162,89 @@ static void sprinkler_hap_event_handler(void* arg, esp_event_base_t event_base,
     }
 }
 
-void zone1_valve_update(uint8_t state)
-{
-        hap_val_t new_val;
-        new_val.i = state;
-        hap_char_update_val(zone1_valve_inuse_char, &new_val);
-}
-
-void zone2_valve_update(uint8_t state)
-{
-        hap_val_t new_val;
-        new_val.i = state;
-        hap_char_update_val(zone2_valve_inuse_char, &new_val);
-}
-
-void master_valve_update(uint8_t state)
-{
-        hap_val_t new_val;
-        new_val.i = state;
-        hap_char_update_val(master_valve_inuse_char, &new_val);
-}
-
-/* 
- * @brief Check the current status of the zone 1 valve and return it to homekit
+/**
+ * @brief Push a valve's requested state to HomeKit and to the irrigation system aggregate
  */
-static int zone1_valve_read(hap_char_t *hc, hap_status_t *status_code, void *serv_priv, void *read_priv)
+void valve_active_update(uint8_t valveno, uint8_t active)
 {
-    if (hap_req_get_ctrl_id(read_priv)) {
-        ESP_LOGI(TAG, "sprinkler received read from %s", hap_req_get_ctrl_id(read_priv));
-    }
-    if (!strcmp(hap_char_get_type_uuid(hc), HAP_CHAR_UUID_IN_USE)) 
+    if (valveno >= VALUE_COUNT)
     {
-        led2_on();
-        hap_val_t new_val;
-        new_val.i = get_valve_state(VALUE_ZONE1);
-        hap_char_update_val(hc, &new_val);
-        zone1_valve_update(new_val.i);
-        *status_code = HAP_STATUS_SUCCESS;
-        ESP_LOGI(TAG,"sprinkler status read as %s", valve_current_state_string(new_val.i));
-        led_off();
+        return;
     }
-    return HAP_SUCCESS;
+    hap_val_t new_val;
+    new_val.i = active;
+    hap_char_update_val(valves[valveno].active_char, &new_val);
+    irrigation_valve_active(valveno, active);
 }
 
 /**
- * @brief Activate the Zone1 valve when homekit asks for it.
+ * @brief Push a valve's relay state to HomeKit and to the irrigation system aggregate
  */
-static int zone1_valve_write(hap_write_data_t write_data[], int count,
-        void *serv_priv, void *write_priv)
+void valve_inuse_update(uint8_t valveno, uint8_t inuse)
 {
-    if (hap_req_get_ctrl_id(write_priv)) {
-        ESP_LOGI(TAG, "sprinkler received write from %s", hap_req_get_ctrl_id(write_priv));
-    }
-    ESP_LOGI(TAG, "sprinkler write called with %d chars", count);
-    int i, ret = HAP_SUCCESS;
-    led1_on();
-    hap_write_data_t *write;
-    for (i = 0; i < count; i++) {
-        write = &write_data[i];
-        if (!strcmp(hap_char_get_type_uuid(write->hc), HAP_CHAR_UUID_ACTIVE)) {
-            ESP_LOGI(TAG, "sprinkler received write In Use: %s", valve_current_state_string(write->val.i));
-            set_valve_state(VALUE_ZONE1, write->val.i);
-            hap_char_update_val(write->hc, &(write->val));
-            zone1_valve_update(write->val.i);
-            *(write->status) = HAP_STATUS_SUCCESS;
-        } else {
-            *(write->status) = HAP_STATUS_RES_ABSENT;
-        }
+    if (valveno >= VALUE_COUNT)
+    {
+        return;
     }
-    led_off();
-    return ret;
+    hap_val_t new_val;
+    new_val.i = inuse;
+    hap_char_update_val(valves[valveno].inuse_char, &new_val);
+    irrigation_valve_inuse(valveno, inuse);
 }
 
 /* 
- * @brief Check the current status of the zone2 valve and return it to homekit
+ * @brief Check the current status of a valve and return it to homekit
  */
-static int zone2_valve_read(hap_char_t *hc, hap_status_t *status_code, void *serv_priv, void *read_priv)
+static int valve_read(hap_char_t *hc, hap_status_t *status_code, void *serv_priv, void *read_priv)
 {
+    sprinkler_valve_t *valve = (sprinkler_valve_t *)serv_priv;
     if (hap_req_get_ctrl_id(read_priv)) {
-        ESP_LOGI(TAG, "sprinkler received read from %s", hap_req_get_ctrl_id(read_priv));
+        ESP_LOGI(TAG, "%s received read from %s", valve->name, hap_req_get_ctrl_id(read_priv));
     }
     if (!strcmp(hap_char_get_type_uuid(hc), HAP_CHAR_UUID_ACTIVE)) 
     {
         led2_on();
-        hap_val_t new_val;
-        new_val.i = get_valve_state(VALUE_ZONE2);
-        hap_char_update_val(hc, &new_val);
-        zone2_valve_update(new_val.i);
+        /* Report the requested state, the relay may still be inside its settle window */
+        uint8_t state = sprinkler_get_target_state(valve->valveno);
+        valve_active_update(valve->valveno, state);
         *status_code = HAP_STATUS_SUCCESS;
-        ESP_LOGI(TAG,"sprinkler status read as %s", valve_current_state_string(new_val.i));
+        ESP_LOGI(TAG,"%s status read as %s", valve->name, valve_current_state_string(state));
         led_off();
     }
+    else if (!strcmp(hap_char_get_type_uuid(hc), HAP_CHAR_UUID_IN_USE))
+    {
+        /* In Use is only written by the actuation task when the relay switches, return what it last set */
+        *status_code = HAP_STATUS_SUCCESS;
+    }
     return HAP_SUCCESS;
 }
 
 /**
- * @brief Activate the zone2 valve when homekit asks for it.
+ * @brief Activate a valve when homekit asks for it.
  */
-static int zone2_valve_write(hap_write_data_t write_data[], int count,
+static int valve_write(hap_write_data_t write_data[], int count,
         void *serv_priv, void *write_priv)
 {
+    sprinkler_valve_t *valve = (sprinkler_valve_t *)serv_priv;
     if (hap_req_get_ctrl_id(write_priv)) {
-        ESP_LOGI(TAG, "sprinkler received write from %s", hap_req_get_ctrl_id(write_priv));
+        ESP_LOGI(TAG, "%s received write from %s", valve->name, hap_req_get_ctrl_id(write_priv));
     }
-    ESP_LOGI(TAG, "sprinkler write called with %d chars", count);
+    ESP_LOGI(TAG, "%s write called with %d chars", valve->name, count);
     int i, ret = HAP_SUCCESS;
-    hap_write_data_t *write;
     led1_on();
+    hap_write_data_t *write;
     for (i = 0; i < count; i++) {
         write = &write_data[i];
         if (!strcmp(hap_char_get_type_uuid(write->hc), HAP_CHAR_UUID_ACTIVE)) {
-            ESP_LOGI(TAG, "sprinkler received write In Use: %s", valve_current_state_string(write->val.i));
-            set_valve_state(VALUE_ZONE2, write->val.i);
-            hap_char_update_val(write->hc, &(write->val));
-            zone2_valve_update(write->val.i);
-            *(write->status) = HAP_STATUS_SUCCESS;
+            ESP_LOGI(TAG, "%s received write In Use: %s", valve->name, valve_current_state_string(write->val.i));
+            if (sprinkler_request_valve_state(valve->valveno, write->val.i)) {
+                /* In Use is updated by the actuation task when the relay switches */
+                valve_active_update(valve->valveno, write->val.i);
+                *(write->status) = HAP_STATUS_SUCCESS;
+            } else {
+                *(write->status) = HAP_STATUS_RES_BUSY;
+                ret = HAP_FAIL;
+            }
         } else {
             *(write->status) = HAP_STATUS_RES_ABSENT;
         }
@@ -246,55 +253,48 @@ static int zone2_valve_write(hap_write_data_t write_data[], int count,
     return ret;
 }
 
-
-/* 
- * @brief Check the current status of the Master Valve and return it to homekit
- */
-static int master_valve_read(hap_char_t *hc, hap_status_t *status_code, void *serv_priv, void *read_priv)
-{
-    if (hap_req_get_ctrl_id(read_priv)) {
-        ESP_LOGI(TAG, "sprinkler received read from %s", hap_req_get_ctrl_id(read_priv));
-    }
-    if (!strcmp(hap_char_get_type_uuid(hc), HAP_CHAR_UUID_ACTIVE)) 
-    {
-        led2_on();
-        hap_val_t new_val;
-        new_val.i = get_valve_state(VALUE_MASTER);
-        hap_char_update_val(hc, &new_val);
-        master_valve_update(new_val.i);
-        *status_code = HAP_STATUS_SUCCESS;
-        ESP_LOGI(TAG,"sprinkler status read as %s", valve_current_state_string(new_val.i));
-        led_off();
-    }
-    return HAP_SUCCESS;
-}
-
 /**
- * @brief Open the Master valve when homekit asks for it.
+ * @brief Turning the irrigation system off from homekit closes every active valve.
  */
-static int master_valve_write(hap_write_data_t write_data[], int count,
+static int irrigation_write(hap_write_data_t write_data[], int count,
         void *serv_priv, void *write_priv)
 {
     if (hap_req_get_ctrl_id(write_priv)) {
-        ESP_LOGI(TAG, "sprinkler received write from %s", hap_req_get_ctrl_id(write_priv));
+        ESP_LOGI(TAG, "irrigation system received write from %s", hap_req_get_ctrl_id(write_priv));
     }
-    ESP_LOGI(TAG, "sprinkler write called with %d chars", count);
-    led1_on();
     int i, ret = HAP_SUCCESS;
     hap_write_data_t *write;
     for (i = 0; i < count; i++) {
         write = &write_data[i];
         if (!strcmp(hap_char_get_type_uuid(write->hc), HAP_CHAR_UUID_ACTIVE)) {
-            ESP_LOGI(TAG, "sprinkler received write In Use: %s", valve_current_state_string(write->val.i));
-            set_valve_state(VALUE_MASTER, write->val.i);
-            hap_char_update_val(write->hc, &(write->val));
-            master_valve_update(write->val.i);
-            *(write->status) = HAP_STATUS_SUCCESS;
+            ESP_LOGI(TAG, "irrigation system received write Active: %s", valve_current_state_string(write->val.i));
+            bool queued = true;
+            if (write->val.i == ACTIVETYPE_INACTIVE) {
+                uint32_t mask = irrigation_active_mask();
+                while (mask) {
+                    uint8_t valveno = __builtin_ctz(mask);
+                    mask &= mask - 1;
+                    if (sprinkler_request_valve_state(valveno, ACTIVETYPE_INACTIVE)) {
+                        valve_active_update(valveno, ACTIVETYPE_INACTIVE);
+                    } else {
+                        queued = false;
+                    }
+                }
+            }
+            /* The aggregate is owned by the irrigation module, report what it holds */
+            hap_val_t new_val;
+            new_val.i = irrigation_active_mask() ? ACTIVETYPE_ACTIVE : ACTIVETYPE_INACTIVE;
+            hap_char_update_val(write->hc, &new_val);
+            if (queued) {
+                *(write->status) = HAP_STATUS_SUCCESS;
+            } else {
+                *(write->status) = HAP_STATUS_RES_BUSY;
+                ret = HAP_FAIL;
+            }
         } else {
             *(write->status) = HAP_STATUS_RES_ABSENT;
         }
     }
-    led_off();
     return ret;
 }
 
@@ -304,14 +304,16 @@ static int master_valve_write(hap_write_data_t write_data[], int count,
 static void homekit_thread_entry(void *p)
 {
     hap_acc_t *sprinkleraccessory = NULL;
-    hap_serv_t *zone1valveservice = NULL;
-    hap_serv_t *zone2valveservice = NULL;
-    hap_serv_t *mastervalveservice = NULL;
+    hap_serv_t *irrigationservice = NULL;
+
+    /* Registered from here so the handle is valid and every ram_budget_register_task() call runs on this task */
+    ram_budget_register_task(SPRINKLER_TASK_NAME, xTaskGetCurrentTaskHandle(), SPRINKLER_TASK_STACKSIZE);
 
     /*
      * Configure the GPIO for the Sprinkler value relays
      */
     sprinkler_setup();
+    start_sprinkler();
 
     /*
      * Setup the reset button to reset homekit to defaults
@@ -357,40 +359,35 @@ static void homekit_thread_entry(void *p)
     uint8_t product_data[] = {'E','S','P','3','2','H','A','P'};
     hap_acc_add_product_data(sprinkleraccessory, product_data, sizeof(product_data));
 
-    ESP_LOGI(TAG, "Creating valve zone 1 service");
-
-    /* Create the Valve Service. Include the "name" since this is a user visible service  */
-    zone1valveservice = hap_serv_valve_create(ACTIVETYPE_INACTIVE, INUSE_INUSE, VALVETYPE_IRRIGRATION);
-    hap_serv_add_char(zone1valveservice, hap_char_name_create("Zone 1 Irrigation Value"));
-    /* Set the write callback for the service */
-    hap_serv_set_write_cb(zone1valveservice, zone1_valve_write);
-    /* Set the read callback for the service (optional) */
-    hap_serv_set_read_cb(zone1valveservice, zone1_valve_read);
-    /* Add the Garage Service to the Accessory Object */
-    hap_acc_add_serv(sprinkleraccessory, zone1valveservice);
-    zone1_valve_inuse_char = hap_serv_get_char_by_uuid(zone1valveservice, HAP_CHAR_UUID_IN_USE);
-
-    /* Create the Valve Service. Include the "name" since this is a user visible service  */
-    zone2valveservice = hap_serv_valve_create(ACTIVETYPE_INACTIVE, INUSE_INUSE, VALVETYPE_IRRIGRATION);
-    hap_serv_add_char(zone2valveservice, hap_char_name_create("Zone 2 Irrigation Value"));
-    /* Set the write callback for the service */
-    hap_serv_set_write_cb(zone2valveservice, zone2_valve_write);
-    /* Set the read callback for the service (optional) */
-    hap_serv_set_read_cb(zone2valveservice, zone2_valve_read);
-    /* Add the Garage Service to the Accessory Object */
-    hap_acc_add_serv(sprinkleraccessory, zone2valveservice);
-    zone2_valve_inuse_char = hap_serv_get_char_by_uuid(zone2valveservice, HAP_CHAR_UUID_IN_USE);
-
-    /* Create the Valve Service. Include the "name" since this is a user visible service  */
-    mastervalveservice = hap_serv_valve_create(ACTIVETYPE_INACTIVE, INUSE_INUSE, VALVETYPE_IRRIGRATION);
-    hap_serv_add_char(mastervalveservice, hap_char_name_create("Master Irrigation Value"));
-    /* Set the write callback for the service */
-    hap_serv_set_write_cb(mastervalveservice, master_valve_write);
-    /* Set the read callback for the service (optional) */
-    hap_serv_set_read_cb(mastervalveservice, master_valve_read);
-    /* Add the Garage Service to the Accessory Object */
-    hap_acc_add_serv(sprinkleraccessory, mastervalveservice);
-    master_valve_inuse_char = hap_serv_get_char_by_uuid(mastervalveservice, HAP_CHAR_UUID_IN_USE);
+    ESP_LOGI(TAG, "Creating irrigation system service");
+
+    /* The Irrigation System is the primary service, all the valves are linked to it */
+    irrigationservice = hap_serv_irrigation_system_create(ACTIVETYPE_INACTIVE, PROGRAMMODE_NONE, INUSE_NOTINUSE);
+    hap_serv_add_char(irrigationservice, hap_char_name_create("Sprinkler"));
+    hap_serv_mark_primary(irrigationservice);
+    hap_serv_set_write_cb(irrigationservice, irrigation_write);
+    hap_acc_add_serv(sprinkleraccessory, irrigationservice);
+    irrigation_init(irrigationservice);
+
+    for (int valveno = 0; valveno < VALUE_COUNT; valveno++)
+    {
+        sprinkler_valve_t *valve = &valves[valveno];
+        ESP_LOGI(TAG, "Creating %s service", valve->name);
+
+        /* Create the Valve Service. Include the "name" since this is a user visible service  */
+        valve->service = hap_serv_valve_create(ACTIVETYPE_INACTIVE, INUSE_NOTINUSE, VALVETYPE_IRRIGRATION);
+        hap_serv_add_char(valve->service, hap_char_name_create((char *)valve->name));
+        hap_serv_set_priv(valve->service, valve);
+        /* Set the write callback for the service */
+        hap_serv_set_write_cb(valve->service, valve_write);
+        /* Set the read callback for the service (optional) */
+        hap_serv_set_read_cb(valve->service, valve_read);
+        /* Add the Valve Service to the Accessory Object and link it to the irrigation system */
+        hap_acc_add_serv(sprinkleraccessory, valve->service);
+        hap_serv_link_serv(irrigationservice, valve->service);
+        valve->active_char = hap_serv_get_char_by_uuid(valve->service, HAP_CHAR_UUID_ACTIVE);
+        valve->inuse_char = hap_serv_get_char_by_uuid(valve->service, HAP_CHAR_UUID_IN_USE);
+    }
 
 #if 0
     /* Create the Firmware Upgrade HomeKit Custom Service.
@@ -448,9 +445,11 @@ static void homekit_thread_entry(void *p)
     ESP_LOGI(TAG, "Starting WIFI...");
     /* Initialize Wi-Fi */
     wifi_setup();
+    power_wifi_configure();
     wifi_connect();
 
     wifi_waitforconnect();
+    power_wifi_connected();
     led1_on();
 
     /* After all the initializations are done, start the HAP core */
@@ -460,6 +459,13 @@ static void homekit_thread_entry(void *p)
     ESP_LOGI(TAG, "HAP initialization complete.");
     led_off();
 
+    /* From here on the supervisor keeps the link up */
+    supervisor_start(cfg.cid);
+
+    /* Report our RAM use now that HAP, Wi-Fi and the valve task have all been set up */
+    ram_budget_task_exiting(xTaskGetCurrentTaskHandle());
+    ram_budget_start();
+
     /* The task ends here. The read/write callbacks will be invoked by the HAP Framework */
     vTaskDelete(NULL);
 }
@@ -479,6 +485,14 @@ void app_main()
     ESP_LOGI(TAG, "[APP] Creating main thread...");
     configure_led();
     led_both();
+    power_setup();
 
-    xTaskCreate(homekit_thread_entry, SPRINKLER_TASK_NAME, SPRINKLER_TASK_STACKSIZE, NULL, SPRINKLER_TASK_PRIORITY, NULL);
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+    xTaskCreateStaticPinnedToCore(homekit_thread_entry, SPRINKLER_TASK_NAME, SPRINKLER_TASK_STACKSIZE, NULL,
+                                  SPRINKLER_TASK_PRIORITY, sprinkler_task_stack, &sprinkler_task_buffer,
+                                  SPRINKLER_TASK_CORE);
+#else
+    xTaskCreatePinnedToCore(homekit_thread_entry, SPRINKLER_TASK_NAME, SPRINKLER_TASK_STACKSIZE, NULL,
+                            SPRINKLER_TASK_PRIORITY, NULL, SPRINKLER_TASK_CORE);
+#endif
 }
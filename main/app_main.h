@@ -2,7 +2,20 @@
 
 #include <stdlib.h>
 
-void zone1_value_update(bool state);
-void zone2_value_update(uint8_t state);
-void master_value_update(uint8_t state);
+/**
+ * @brief Report a valve's requested state to HomeKit as Active, and to the irrigation system
+ *
+ * @param valveno Valve number (ValveNo type)
+ * @param active Requested state (ActiveType)
+ */
+void valve_active_update(uint8_t valveno, uint8_t active);
+
+/**
+ * @brief Report a valve's relay state to HomeKit as In Use, and to the irrigation system. Only
+ * the actuation task calls this, once the relay has switched, so In Use never goes backwards.
+ *
+ * @param valveno Valve number (ValveNo type)
+ * @param inuse Relay state (InUseState)
+ */
+void valve_inuse_update(uint8_t valveno, uint8_t inuse);
 void reset_to_factory_handler(void);
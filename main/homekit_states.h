@@ -76,4 +76,17 @@ enum ActiveType {
     ACTIVETYPE_ACTIVE = 1
 };
 
+/**
+ * Program Mode.
+ *
+ * This characteristic describes if there are programs scheduled on the accessory. If there are Programs
+ * scheduled on the accessory and the accessory is used for manual operation, the value of this
+ * characteristic must be Program Scheduled, currently overridden to manual mode.
+ */
+enum ProgramMode {
+    PROGRAMMODE_NONE = 0,
+    PROGRAMMODE_SCHEDULED = 1,
+    PROGRAMMODE_MANUAL = 2
+};
+
 char *valve_current_state_string(uint8_t state);
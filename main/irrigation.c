@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020 <Mark Buckaway> MIT License
+ *
+ * HomeKit Irrigation System aggregate state
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+
+#include <hap.h>
+#include <hap_apple_chars.h>
+
+#include "irrigation.h"
+#include "sprinkler.h"
+#include "homekit_states.h"
+
+static const char *TAG = "IRRIGATION";
+
+static SemaphoreHandle_t irrigation_lock = NULL;
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+static StaticSemaphore_t irrigation_lock_buffer;
+#endif
+static hap_char_t *system_active_char = NULL;
+static hap_char_t *system_inuse_char = NULL;
+
+static uint32_t active_mask = 0;
+static uint32_t inuse_mask = 0;
+
+static void irrigation_char_set(hap_char_t *hc, uint8_t value)
+{
+    if (hc)
+    {
+        hap_val_t new_val;
+        new_val.i = value;
+        hap_char_update_val(hc, &new_val);
+    }
+}
+
+void irrigation_init(hap_serv_t *service)
+{
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+    irrigation_lock = xSemaphoreCreateMutexStatic(&irrigation_lock_buffer);
+#else
+    irrigation_lock = xSemaphoreCreateMutex();
+#endif
+    system_active_char = hap_serv_get_char_by_uuid(service, HAP_CHAR_UUID_ACTIVE);
+    system_inuse_char = hap_serv_get_char_by_uuid(service, HAP_CHAR_UUID_IN_USE);
+}
+
+/**
+ * @brief Flip one valve's bit in an aggregate mask and update the aggregate characteristic
+ * when the mask goes from empty to non-empty or back
+ */
+static void irrigation_mask_set(uint32_t *mask, hap_char_t *hc, uint8_t valveno, bool set,
+                                uint8_t set_value, uint8_t clear_value, const char *name)
+{
+    if (valveno >= SPRINKLER_MAX_VALVES || irrigation_lock == NULL)
+    {
+        return;
+    }
+    uint32_t bit = 1UL << valveno;
+
+    /* The lock is held across the characteristic update so concurrent transitions reach HomeKit in order */
+    xSemaphoreTake(irrigation_lock, portMAX_DELAY);
+    uint32_t old_mask = *mask;
+    *mask = set ? (*mask | bit) : (*mask & ~bit);
+    if ((old_mask == 0) != (*mask == 0))
+    {
+        ESP_LOGI(TAG, "Irrigation system %s%s", *mask ? "" : "not ", name);
+        irrigation_char_set(hc, *mask ? set_value : clear_value);
+    }
+    xSemaphoreGive(irrigation_lock);
+}
+
+void irrigation_valve_active(uint8_t valveno, uint8_t active)
+{
+    irrigation_mask_set(&active_mask, system_active_char, valveno, active == ACTIVETYPE_ACTIVE,
+                        ACTIVETYPE_ACTIVE, ACTIVETYPE_INACTIVE, "active");
+}
+
+void irrigation_valve_inuse(uint8_t valveno, uint8_t inuse)
+{
+    irrigation_mask_set(&inuse_mask, system_inuse_char, valveno, inuse == INUSE_INUSE,
+                        INUSE_INUSE, INUSE_NOTINUSE, "in use");
+}
+
+uint32_t irrigation_active_mask(void)
+{
+    return active_mask;
+}
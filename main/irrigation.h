@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <hap.h>
+
+/**
+ * Aggregate state of the HomeKit Irrigation System service.
+ *
+ * Every linked valve owns one bit of the active and in use masks. A valve change flips
+ * its bit and the aggregate characteristics are only written to HomeKit when a mask goes
+ * from empty to non-empty or back, so each transition is O(1) whatever the zone count.
+ *
+ * There is no scheduler on the device, schedules are HomeKit automations, so Program Mode
+ * stays at "No program scheduled".
+ */
+
+/**
+ * @brief Bind the aggregate state to the Irrigation System service characteristics
+ *
+ * @param service Irrigation System service created with hap_serv_irrigation_system_create()
+ */
+void irrigation_init(hap_serv_t *service);
+
+/**
+ * @brief Report a change of a valve's requested state to the irrigation system Active
+ *
+ * @param valveno Valve number (ValveNo type)
+ * @param active Valve active state (ActiveType)
+ */
+void irrigation_valve_active(uint8_t valveno, uint8_t active);
+
+/**
+ * @brief Report a relay switching to the irrigation system In Use. Only the actuation task calls this.
+ *
+ * @param valveno Valve number (ValveNo type)
+ * @param inuse Valve in use state (InUseState)
+ */
+void irrigation_valve_inuse(uint8_t valveno, uint8_t inuse);
+
+/**
+ * @brief Get the bit mask of active valves (bit n = ValveNo n)
+ */
+uint32_t irrigation_active_mask(void);
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2020 <Mark Buckaway> MIT License
+ *
+ * Scheduling jitter statistics for the valve actuation task
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
+#include <esp_log.h>
+
+#include "jitter.h"
+
+static const char *TAG = "JITTER";
+
+/* Upper bounds (us) of the histogram buckets. The last bucket catches everything above. */
+static const int64_t jitter_bucket_limits[] = { 50, 100, 250, 500, 1000, 5000 };
+#define JITTER_BUCKETS ((sizeof(jitter_bucket_limits) / sizeof(jitter_bucket_limits[0])) + 1)
+
+typedef struct {
+    uint32_t count;
+    int64_t min_us;
+    int64_t max_us;
+    int64_t total_us;
+    uint32_t buckets[JITTER_BUCKETS];
+} jitter_stats_t;
+
+static const char *jitter_load_names[JITTER_LOAD_COUNT] = {
+    "idle",
+    "pairing"
+};
+
+static volatile bool jitter_pairing = false;
+/* Samples are added by the actuation task and copied out by the report, nothing else holds this */
+static portMUX_TYPE jitter_lock = portMUX_INITIALIZER_UNLOCKED;
+static jitter_stats_t wakeup_stats[JITTER_LOAD_COUNT];
+static jitter_stats_t command_stats[JITTER_LOAD_COUNT];
+
+#if defined(CONFIG_SPRINKLER_JITTER_STATS) && defined(CONFIG_SPRINKLER_STATIC_ALLOCATION)
+static StaticTimer_t jitter_report_timer_buffer;
+#endif
+
+static void jitter_stats_add(jitter_stats_t *stats, int64_t value_us)
+{
+    if (stats->count == 0 || value_us < stats->min_us)
+    {
+        stats->min_us = value_us;
+    }
+    if (stats->count == 0 || value_us > stats->max_us)
+    {
+        stats->max_us = value_us;
+    }
+    stats->count++;
+    stats->total_us += value_us;
+
+    size_t bucket = 0;
+    while (bucket < JITTER_BUCKETS - 1 && value_us > jitter_bucket_limits[bucket])
+    {
+        bucket++;
+    }
+    stats->buckets[bucket]++;
+}
+
+static void jitter_stats_log(const char *name, const char *load, const jitter_stats_t *stats)
+{
+    if (stats->count == 0)
+    {
+        ESP_LOGI(TAG, "%s (%s): no samples", name, load);
+        return;
+    }
+    ESP_LOGI(TAG, "%s (%s): n=%u min=%lldus avg=%lldus max=%lldus",
+             name, load, stats->count, stats->min_us, stats->total_us / stats->count, stats->max_us);
+
+    char line[128];
+    int len = 0;
+    for (size_t i = 0; i < JITTER_BUCKETS; i++)
+    {
+        if (i < JITTER_BUCKETS - 1)
+        {
+            len += snprintf(line + len, sizeof(line) - len, " <=%lld:%u", jitter_bucket_limits[i], stats->buckets[i]);
+        }
+        else
+        {
+            len += snprintf(line + len, sizeof(line) - len, " >%lld:%u", jitter_bucket_limits[i - 1], stats->buckets[i]);
+        }
+        if ((size_t)len >= sizeof(line))
+        {
+            break;
+        }
+    }
+    ESP_LOGI(TAG, "%s (%s) histogram us:%s", name, load, line);
+}
+
+void jitter_set_pairing(bool pairing)
+{
+    jitter_pairing = pairing;
+}
+
+void jitter_record_wakeup(int64_t lateness_us)
+{
+    portENTER_CRITICAL(&jitter_lock);
+    jitter_stats_add(&wakeup_stats[jitter_pairing ? JITTER_LOAD_PAIRING : JITTER_LOAD_IDLE], lateness_us);
+    portEXIT_CRITICAL(&jitter_lock);
+}
+
+void jitter_record_command(int64_t latency_us)
+{
+    portENTER_CRITICAL(&jitter_lock);
+    jitter_stats_add(&command_stats[jitter_pairing ? JITTER_LOAD_PAIRING : JITTER_LOAD_IDLE], latency_us);
+    portEXIT_CRITICAL(&jitter_lock);
+}
+
+void jitter_report(void)
+{
+    jitter_stats_t wakeups[JITTER_LOAD_COUNT];
+    jitter_stats_t commands[JITTER_LOAD_COUNT];
+
+    /* Log from a copy, the UART output must not hold up the actuation task */
+    portENTER_CRITICAL(&jitter_lock);
+    memcpy(wakeups, wakeup_stats, sizeof(wakeups));
+    memcpy(commands, command_stats, sizeof(commands));
+    portEXIT_CRITICAL(&jitter_lock);
+
+    for (int load = 0; load < JITTER_LOAD_COUNT; load++)
+    {
+        jitter_stats_log("wakeup jitter", jitter_load_names[load], &wakeups[load]);
+        jitter_stats_log("command latency", jitter_load_names[load], &commands[load]);
+    }
+}
+
+#ifdef CONFIG_SPRINKLER_JITTER_STATS
+static void jitter_report_timer_cb(TimerHandle_t timer)
+{
+    jitter_report();
+}
+
+void jitter_start(void)
+{
+    const TickType_t period = (TickType_t)CONFIG_SPRINKLER_JITTER_REPORT_INTERVAL * configTICK_RATE_HZ;
+    TimerHandle_t timer;
+
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+    timer = xTimerCreateStatic("jitter_report", period, pdTRUE, NULL, jitter_report_timer_cb, &jitter_report_timer_buffer);
+#else
+    timer = xTimerCreate("jitter_report", period, pdTRUE, NULL, jitter_report_timer_cb);
+#endif
+    if (timer == NULL || xTimerStart(timer, 0) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Unable to start the jitter report timer");
+    }
+}
+#endif
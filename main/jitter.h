@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Scheduling jitter instrumentation for the valve actuation task.
+ *
+ * Samples are kept in two sets: one while a HomeKit controller is pairing (heavy
+ * SRP/Ed25519 crypto on PRO_CPU) and one for normal operation, so the two can be
+ * compared directly in the log.
+ */
+
+enum JitterLoad {
+    JITTER_LOAD_IDLE = 0,
+    JITTER_LOAD_PAIRING = 1,
+    JITTER_LOAD_COUNT
+};
+
+/**
+ * @brief Mark whether a pairing is in progress. Called from the HAP event handler.
+ */
+void jitter_set_pairing(bool pairing);
+
+/**
+ * @brief Record a periodic wakeup of the actuation task
+ *
+ * @param lateness_us Time the task ran after its scheduled release. Release times advance by a
+ * fixed period from the task start, so a late wakeup is not hidden by the next one.
+ */
+void jitter_record_wakeup(int64_t lateness_us);
+
+/**
+ * @brief Record the delay between a valve command being queued and the actuation task running it
+ *
+ * @param latency_us Queue to run latency
+ */
+void jitter_record_command(int64_t latency_us);
+
+/**
+ * @brief Log the collected statistics. Works from a snapshot, call it from a low priority task.
+ */
+void jitter_report(void);
+
+/**
+ * @brief Start the periodic report on the FreeRTOS timer task, so the logging never runs in
+ * the actuation task it measures
+ */
+void jitter_start(void);
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2020 <Mark Buckaway> MIT License
+ *
+ * Wi-Fi/HAP link supervisor state machine
+ */
+
+#include <string.h>
+
+#include "link_supervisor.h"
+
+/* Signed difference so the millisecond clock can wrap */
+static bool link_time_reached(uint32_t now_ms, uint32_t deadline_ms)
+{
+    return (int32_t)(now_ms - deadline_ms) >= 0;
+}
+
+/**
+ * @brief Schedule the next attempt after half the backoff plus a random part of the other half,
+ * so a street full of controllers does not hammer the router in step after it reboots.
+ */
+static void link_schedule_attempt(link_supervisor_t *ls, uint32_t now_ms)
+{
+    uint32_t half = ls->backoff_ms / 2;
+    uint32_t jitter = ls->ops.random ? ls->ops.random(ls->ops.ctx) % (half + 1) : 0;
+    ls->next_attempt_ms = now_ms + half + jitter;
+    ls->state = LINK_STATE_DOWN;
+
+    ls->backoff_ms = (ls->backoff_ms > ls->config.backoff_max_ms / 2) ? ls->config.backoff_max_ms : ls->backoff_ms * 2;
+}
+
+static void link_went_down(link_supervisor_t *ls, uint32_t now_ms)
+{
+    ls->down_since_ms = now_ms;
+    ls->backoff_ms = ls->config.backoff_min_ms;
+    ls->attempt = 0;
+    ls->sessions = 0;
+    if (ls->ops.link_changed)
+    {
+        ls->ops.link_changed(ls->ops.ctx, false);
+    }
+    link_schedule_attempt(ls, now_ms);
+}
+
+static void link_came_up(link_supervisor_t *ls, uint32_t now_ms)
+{
+    uint32_t outage = now_ms - ls->down_since_ms;
+    link_supervisor_stats_t *stats = &ls->stats;
+
+    if (stats->reconnects == 0 || outage < stats->min_ms)
+    {
+        stats->min_ms = outage;
+    }
+    if (outage > stats->max_ms)
+    {
+        stats->max_ms = outage;
+    }
+    stats->last_ms = outage;
+    stats->total_ms += outage;
+    stats->reconnects++;
+
+    /* No announcement here, mDNS announces the accessory itself when the interface gets its address */
+    ls->state = LINK_STATE_UP;
+    ls->silent_since_ms = now_ms;
+    if (ls->ops.link_changed)
+    {
+        ls->ops.link_changed(ls->ops.ctx, true);
+    }
+}
+
+static void link_tick(link_supervisor_t *ls, uint32_t now_ms)
+{
+    switch (ls->state)
+    {
+        case LINK_STATE_DOWN:
+            if (link_time_reached(now_ms, ls->next_attempt_ms))
+            {
+                ls->attempt++;
+                ls->stats.attempts++;
+                ls->attempt_deadline_ms = now_ms + ls->config.connect_timeout_ms;
+                ls->state = LINK_STATE_CONNECTING;
+                if (ls->ops.connect)
+                {
+                    ls->ops.connect(ls->ops.ctx, ls->cached_ap && ls->attempt <= ls->config.fast_attempts);
+                }
+            }
+            break;
+        case LINK_STATE_CONNECTING:
+        case LINK_STATE_ASSOCIATED:
+            if (link_time_reached(now_ms, ls->attempt_deadline_ms))
+            {
+                link_schedule_attempt(ls, now_ms);
+            }
+            break;
+        case LINK_STATE_UP:
+            /* Paired controllers keep a session open. If none has come back, the accessory has
+             * probably dropped out of mDNS, so announce it again. Each announcement that brings
+             * nobody back doubles the wait before the next one. */
+            if (ls->config.mdns_silence_ms && ls->controller_seen && ls->sessions == 0 &&
+                link_time_reached(now_ms, ls->silent_since_ms + ls->announce_interval_ms))
+            {
+                ls->silent_since_ms = now_ms;
+                ls->announce_interval_ms = (ls->announce_interval_ms > ls->config.mdns_silence_max_ms / 2) ?
+                                           ls->config.mdns_silence_max_ms : ls->announce_interval_ms * 2;
+                if (ls->announce_interval_ms < ls->config.mdns_silence_ms)
+                {
+                    ls->announce_interval_ms = ls->config.mdns_silence_ms;
+                }
+                if (ls->ops.announce)
+                {
+                    ls->ops.announce(ls->ops.ctx);
+                    ls->stats.reannounces++;
+                }
+            }
+            break;
+    }
+}
+
+void link_supervisor_init(link_supervisor_t *ls, const link_supervisor_config_t *config,
+                          const link_supervisor_ops_t *ops, uint32_t now_ms)
+{
+    memset(ls, 0, sizeof(*ls));
+    ls->config = *config;
+    ls->ops = *ops;
+    ls->state = LINK_STATE_UP;
+    ls->backoff_ms = config->backoff_min_ms;
+    ls->silent_since_ms = now_ms;
+    ls->announce_interval_ms = config->mdns_silence_ms;
+}
+
+void link_supervisor_set_cached_ap(link_supervisor_t *ls, bool cached)
+{
+    ls->cached_ap = cached;
+}
+
+void link_supervisor_handle_event(link_supervisor_t *ls, const link_event_t *event)
+{
+    uint32_t now_ms = event->time_ms;
+
+    switch (event->type)
+    {
+        case LINK_EVENT_TICK:
+            link_tick(ls, now_ms);
+            break;
+        case LINK_EVENT_CONNECTED:
+            if (ls->state == LINK_STATE_DOWN || ls->state == LINK_STATE_CONNECTING)
+            {
+                /* Also covers the driver reconnecting on its own between our attempts */
+                ls->state = LINK_STATE_ASSOCIATED;
+                ls->attempt_deadline_ms = now_ms + ls->config.connect_timeout_ms;
+            }
+            break;
+        case LINK_EVENT_GOT_IP:
+            if (ls->state != LINK_STATE_UP)
+            {
+                link_came_up(ls, now_ms);
+            }
+            break;
+        case LINK_EVENT_DISCONNECTED:
+            if (ls->state == LINK_STATE_UP)
+            {
+                link_went_down(ls, now_ms);
+            }
+            else if (ls->state != LINK_STATE_DOWN)
+            {
+                /* The attempt failed, back off before the next one */
+                link_schedule_attempt(ls, now_ms);
+            }
+            break;
+        case LINK_EVENT_LOST_IP:
+            /* The lost IP timer fires long after the disconnect that caused it, usually in the
+             * middle of a reconnect attempt. Only take it as the link going down while up. */
+            if (ls->state == LINK_STATE_UP)
+            {
+                link_went_down(ls, now_ms);
+            }
+            break;
+        case LINK_EVENT_CONTROLLER_CONNECTED:
+            ls->controller_seen = true;
+            ls->sessions++;
+            ls->announce_interval_ms = ls->config.mdns_silence_ms;
+            break;
+        case LINK_EVENT_CONTROLLER_DISCONNECTED:
+            if (ls->sessions > 0)
+            {
+                ls->sessions--;
+            }
+            if (ls->sessions == 0)
+            {
+                ls->silent_since_ms = now_ms;
+            }
+            break;
+    }
+}
+
+uint32_t link_supervisor_next_timeout(const link_supervisor_t *ls, uint32_t now_ms)
+{
+    uint32_t deadline;
+
+    switch (ls->state)
+    {
+        case LINK_STATE_DOWN:
+            deadline = ls->next_attempt_ms;
+            break;
+        case LINK_STATE_CONNECTING:
+        case LINK_STATE_ASSOCIATED:
+            deadline = ls->attempt_deadline_ms;
+            break;
+        case LINK_STATE_UP:
+        default:
+            if (!ls->config.mdns_silence_ms || !ls->controller_seen || ls->sessions > 0)
+            {
+                return UINT32_MAX;
+            }
+            deadline = ls->silent_since_ms + ls->announce_interval_ms;
+            break;
+    }
+    return link_time_reached(now_ms, deadline) ? 0 : deadline - now_ms;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Wi-Fi/HAP link supervisor state machine.
+ *
+ * This file has no ESP-IDF or FreeRTOS dependencies. Events carry their own timestamp and
+ * all actions go through the ops callbacks, so the state machine can be built and driven on
+ * Linux from a simulated Wi-Fi event source. supervisor.c binds it to the real Wi-Fi driver.
+ */
+
+typedef enum {
+    LINK_EVENT_TICK = 0,                /* Time has passed, run any due timers */
+    LINK_EVENT_CONNECTED,               /* Station associated with the AP */
+    LINK_EVENT_DISCONNECTED,            /* Station lost the AP or an attempt failed */
+    LINK_EVENT_GOT_IP,                  /* Station has an IP address, link is usable */
+    LINK_EVENT_LOST_IP,                 /* IP address lease lost, ignored unless the link is up */
+    LINK_EVENT_CONTROLLER_CONNECTED,    /* A HomeKit controller opened a session */
+    LINK_EVENT_CONTROLLER_DISCONNECTED, /* A HomeKit controller closed a session */
+} link_event_type_t;
+
+typedef struct {
+    link_event_type_t type;
+    uint32_t time_ms;
+} link_event_t;
+
+typedef enum {
+    LINK_STATE_UP = 0,                  /* Associated and addressed */
+    LINK_STATE_DOWN,                    /* Waiting for the next reconnect attempt */
+    LINK_STATE_CONNECTING,              /* Reconnect attempt in progress */
+    LINK_STATE_ASSOCIATED,              /* Associated, waiting for an IP address */
+} link_state_t;
+
+typedef struct {
+    /* Start a connection attempt, pinned to the cached BSSID/channel when use_cached_ap is set */
+    void (*connect)(void *ctx, bool use_cached_ap);
+    /* Re-announce the accessory over mDNS after a long controller silence */
+    void (*announce)(void *ctx);
+    /* The link went down or came back */
+    void (*link_changed)(void *ctx, bool up);
+    /* Random number for the backoff jitter */
+    uint32_t (*random)(void *ctx);
+    void *ctx;
+} link_supervisor_ops_t;
+
+typedef struct {
+    uint32_t backoff_min_ms;            /* First reconnect delay */
+    uint32_t backoff_max_ms;            /* Reconnect delay cap */
+    uint32_t connect_timeout_ms;        /* Give up on an attempt that has not produced an IP */
+    uint8_t fast_attempts;              /* Attempts using the cached BSSID/channel before a full scan */
+    uint32_t mdns_silence_ms;           /* Re-announce if no controller reconnects within this time */
+    uint32_t mdns_silence_max_ms;       /* The re-announce interval doubles up to this while controllers stay away */
+} link_supervisor_config_t;
+
+typedef struct {
+    uint32_t reconnects;                /* Completed reconnects */
+    uint32_t attempts;                  /* Connection attempts started */
+    uint32_t reannounces;               /* mDNS re-announcements */
+    uint32_t last_ms;                   /* Duration of the last outage */
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint64_t total_ms;
+} link_supervisor_stats_t;
+
+typedef struct {
+    link_supervisor_config_t config;
+    link_supervisor_ops_t ops;
+    link_state_t state;
+    bool cached_ap;
+    uint32_t down_since_ms;
+    uint32_t next_attempt_ms;
+    uint32_t attempt_deadline_ms;
+    uint32_t backoff_ms;
+    uint32_t attempt;
+    uint32_t sessions;
+    bool controller_seen;
+    uint32_t silent_since_ms;
+    uint32_t announce_interval_ms;
+    link_supervisor_stats_t stats;
+} link_supervisor_t;
+
+/**
+ * @brief Initialise the supervisor. The link is assumed up, as it is started once Wi-Fi has connected.
+ */
+void link_supervisor_init(link_supervisor_t *ls, const link_supervisor_config_t *config,
+                          const link_supervisor_ops_t *ops, uint32_t now_ms);
+
+/**
+ * @brief Mark whether a BSSID/channel is cached for fast reconnects
+ */
+void link_supervisor_set_cached_ap(link_supervisor_t *ls, bool cached);
+
+/**
+ * @brief Feed an event to the state machine
+ */
+void link_supervisor_handle_event(link_supervisor_t *ls, const link_event_t *event);
+
+/**
+ * @brief Milliseconds until the state machine next needs a LINK_EVENT_TICK, UINT32_MAX if none
+ */
+uint32_t link_supervisor_next_timeout(const link_supervisor_t *ls, uint32_t now_ms);
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2020 <Mark Buckaway> MIT License
+ *
+ * Power management: DFS, automatic light sleep and wakeup accounting
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <esp_log.h>
+#include <esp_pm.h>
+#include <esp_wifi.h>
+#include <esp_freertos_hooks.h>
+#include "esp32/pm.h"
+
+#include "power.h"
+
+static const char *TAG = "POWER";
+
+static uint32_t wakeups[POWER_WAKE_COUNT];
+
+void power_record_wakeup(enum PowerWakeSource source)
+{
+    if (source < POWER_WAKE_COUNT)
+    {
+        __atomic_add_fetch(&wakeups[source], 1, __ATOMIC_RELAXED);
+    }
+}
+
+#ifdef CONFIG_SPRINKLER_POWER_MANAGEMENT
+
+static const char *power_wake_names[POWER_WAKE_COUNT] = {
+    "timer",
+    "hap request"
+};
+
+static uint32_t idle_exits[portNUM_PROCESSORS];
+
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+static StaticTimer_t power_report_timer_buffer;
+#endif
+
+/**
+ * The idle hook runs on every pass of the idle loop, so this counts every return to idle:
+ * after light sleeps, but also after each tick interrupt and any other interrupt that
+ * ended a waiti. It is not a light sleep count. Each core only touches its own counter.
+ */
+static bool power_idle_hook_cpu0(void)
+{
+    idle_exits[0]++;
+    return true;
+}
+
+#if portNUM_PROCESSORS > 1
+static bool power_idle_hook_cpu1(void)
+{
+    idle_exits[1]++;
+    return true;
+}
+#endif
+
+static void power_report_timer_cb(TimerHandle_t timer)
+{
+    power_report();
+}
+
+void power_setup(void)
+{
+    esp_pm_config_esp32_t pm_config = {
+        .max_freq_mhz = CONFIG_SPRINKLER_PM_MAX_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_SPRINKLER_PM_MIN_FREQ_MHZ,
+        .light_sleep_enable = true
+    };
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to configure power management: %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "DFS %d-%d MHz with automatic light sleep", pm_config.min_freq_mhz, pm_config.max_freq_mhz);
+
+    esp_register_freertos_idle_hook_for_cpu(power_idle_hook_cpu0, 0);
+#if portNUM_PROCESSORS > 1
+    esp_register_freertos_idle_hook_for_cpu(power_idle_hook_cpu1, 1);
+#endif
+
+    const TickType_t period = pdMS_TO_TICKS(CONFIG_SPRINKLER_PM_REPORT_INTERVAL * 1000);
+    TimerHandle_t timer;
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+    timer = xTimerCreateStatic("power_report", period, pdTRUE, NULL, power_report_timer_cb, &power_report_timer_buffer);
+#else
+    timer = xTimerCreate("power_report", period, pdTRUE, NULL, power_report_timer_cb);
+#endif
+    if (timer == NULL || xTimerStart(timer, 0) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Unable to start the power report timer");
+    }
+}
+
+void power_wifi_configure(void)
+{
+    wifi_config_t wifi_config;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to read the Wi-Fi station config");
+        return;
+    }
+    /* The AP buffers our traffic between wakeups, this bounds the added HAP latency to about listen_interval * 102.4ms */
+    wifi_config.sta.listen_interval = CONFIG_SPRINKLER_PM_LISTEN_INTERVAL;
+    if (esp_wifi_set_config(WIFI_IF_STA, &wifi_config) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to set the Wi-Fi listen interval");
+    }
+}
+
+void power_wifi_connected(void)
+{
+    esp_err_t err = esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to enable Wi-Fi modem sleep: %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "Wi-Fi modem sleep on, listen interval %d beacons", CONFIG_SPRINKLER_PM_LISTEN_INTERVAL);
+}
+
+void power_report(void)
+{
+    static uint32_t last_wakeups[POWER_WAKE_COUNT];
+    static uint32_t last_idle_exits;
+
+    for (int source = 0; source < POWER_WAKE_COUNT; source++)
+    {
+        uint32_t count = wakeups[source];
+        ESP_LOGI(TAG, "wakeups %-12s %u", power_wake_names[source], count - last_wakeups[source]);
+        last_wakeups[source] = count;
+    }
+
+    uint32_t exits = 0;
+    for (int cpu = 0; cpu < portNUM_PROCESSORS; cpu++)
+    {
+        exits += idle_exits[cpu];
+    }
+    ESP_LOGI(TAG, "idle-loop exits (both cores, includes tick interrupts) %u in %d seconds",
+             exits - last_idle_exits, CONFIG_SPRINKLER_PM_REPORT_INTERVAL);
+    last_idle_exits = exits;
+#ifdef CONFIG_PM_PROFILING
+    esp_pm_dump_locks(stdout);
+#endif
+}
+
+#else
+
+void power_setup(void)
+{
+    ESP_LOGI(TAG, "Power management disabled");
+}
+
+void power_wifi_configure(void)
+{
+}
+
+void power_wifi_connected(void)
+{
+}
+
+void power_report(void)
+{
+}
+
+#endif
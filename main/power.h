@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Wakeup sources counted by the power report. Timer wakeups are counted by the actuation
+ * task, HAP requests once per request from the HAP events. Wakeups from other sources
+ * (Wi-Fi beacons, driver and system timers) cannot be told apart from here, the report only
+ * gives the total number of idle-loop exits alongside.
+ */
+enum PowerWakeSource {
+    POWER_WAKE_TIMER = 0,
+    POWER_WAKE_HAP_REQUEST = 1,
+    POWER_WAKE_COUNT
+};
+
+/**
+ * @brief Enable DFS and automatic light sleep and start the wakeup accounting
+ */
+void power_setup(void);
+
+/**
+ * @brief Set the Wi-Fi listen interval. Call after the driver is set up and before it connects.
+ */
+void power_wifi_configure(void);
+
+/**
+ * @brief Enable Wi-Fi modem sleep once the station is connected
+ */
+void power_wifi_connected(void);
+
+/**
+ * @brief Count a wakeup caused by the given source
+ */
+void power_record_wakeup(enum PowerWakeSource source);
+
+/**
+ * @brief Log the wakeup counts per source since the previous report
+ */
+void power_report(void);
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2020 <Mark Buckaway> MIT License
+ *
+ * RAM budget of the sprinkler firmware against the measured high-water marks
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+
+#include "ram_budget.h"
+
+static const char *TAG = "RAM";
+
+_Static_assert(SPRINKLER_RAM_BYTES <= CONFIG_SPRINKLER_RAM_BUDGET,
+               "Sprinkler RAM use is over CONFIG_SPRINKLER_RAM_BUDGET, raise the budget or lower the zone count");
+
+/* Volatile so the run-time report really reads it, which keeps it through --gc-sections */
+const volatile ram_budget_info_t sprinkler_ram_budget_info = {
+    .ram_bytes = SPRINKLER_RAM_BYTES,
+    .budget_bytes = CONFIG_SPRINKLER_RAM_BUDGET,
+    .task_bytes = SPRINKLER_RAM_TASK_BYTES,
+    .queue_bytes = SPRINKLER_RAM_QUEUE_BYTES,
+    .other_bytes = SPRINKLER_RAM_OTHER_BYTES,
+    .valves = VALUE_COUNT,
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+    .static_allocation = 1,
+#else
+    .static_allocation = 0,
+#endif
+};
+
+#define RAM_BUDGET_MAX_TASKS 6
+
+typedef struct {
+    const char *name;
+    TaskHandle_t task;
+    uint32_t stack_bytes;
+    uint32_t min_free_bytes;
+} ram_budget_task_t;
+
+static ram_budget_task_t budget_tasks[RAM_BUDGET_MAX_TASKS];
+static int budget_task_count = 0;
+
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+static StaticTimer_t ram_report_timer_buffer;
+#endif
+
+void ram_budget_register_task(const char *name, TaskHandle_t task, uint32_t stack_bytes)
+{
+    if (budget_task_count >= RAM_BUDGET_MAX_TASKS)
+    {
+        ESP_LOGW(TAG, "No room to track task %s", name);
+        return;
+    }
+    budget_tasks[budget_task_count].name = name;
+    budget_tasks[budget_task_count].task = task;
+    budget_tasks[budget_task_count].stack_bytes = stack_bytes;
+    budget_tasks[budget_task_count].min_free_bytes = stack_bytes;
+    budget_task_count++;
+}
+
+void ram_budget_task_exiting(TaskHandle_t task)
+{
+    for (int i = 0; i < budget_task_count; i++)
+    {
+        if (budget_tasks[i].task == task)
+        {
+            budget_tasks[i].min_free_bytes = uxTaskGetStackHighWaterMark(task);
+            budget_tasks[i].task = NULL;
+        }
+    }
+}
+
+void ram_budget_report(void)
+{
+    uint32_t stack_total = 0;
+    uint32_t stack_used = 0;
+
+    for (int i = 0; i < budget_task_count; i++)
+    {
+        ram_budget_task_t *entry = &budget_tasks[i];
+        if (entry->task)
+        {
+            entry->min_free_bytes = uxTaskGetStackHighWaterMark(entry->task);
+        }
+        uint32_t used = entry->stack_bytes - entry->min_free_bytes;
+        stack_total += entry->stack_bytes;
+        stack_used += used;
+        ESP_LOGI(TAG, "task %-16s stack %5u bytes, peak %5u used (%u%%)%s",
+                 entry->name, entry->stack_bytes, used, (used * 100) / entry->stack_bytes,
+                 entry->task ? "" : ", exited");
+    }
+    ESP_LOGI(TAG, "tasks: %u of %u stack bytes used at peak", stack_used, stack_total);
+    ESP_LOGI(TAG, "budget: %u of %u bytes for %u valves (%s allocation)",
+             sprinkler_ram_budget_info.ram_bytes, sprinkler_ram_budget_info.budget_bytes,
+             sprinkler_ram_budget_info.valves, sprinkler_ram_budget_info.static_allocation ? "static" : "heap");
+    ESP_LOGI(TAG, "heap: %u free, %u minimum free, %u largest free block",
+             heap_caps_get_free_size(MALLOC_CAP_8BIT),
+             heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+             heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
+
+static void ram_report_timer_cb(TimerHandle_t timer)
+{
+    ram_budget_report();
+}
+
+void ram_budget_start(void)
+{
+    const TickType_t period = pdMS_TO_TICKS(CONFIG_SPRINKLER_RAM_REPORT_INTERVAL * 1000);
+    TimerHandle_t timer;
+
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+    timer = xTimerCreateStatic("ram_report", period, pdTRUE, NULL, ram_report_timer_cb, &ram_report_timer_buffer);
+#else
+    timer = xTimerCreate("ram_report", period, pdTRUE, NULL, ram_report_timer_cb);
+#endif
+    ram_budget_report();
+    if (timer == NULL || xTimerStart(timer, 0) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Unable to start the RAM report timer");
+    }
+}
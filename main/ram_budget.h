@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
+
+#include "sprinkler.h"
+#include "link_supervisor.h"
+
+#if defined(CONFIG_SPRINKLER_STATIC_ALLOCATION) && !configSUPPORT_STATIC_ALLOCATION
+#error "CONFIG_SPRINKLER_STATIC_ALLOCATION needs the FreeRTOS static allocation API (CONFIG_FREERTOS_SUPPORT_STATIC_ALLOCATION)"
+#endif
+
+/*
+ * Sizes of the tasks, queues and buffers owned by the firmware. Anything that depends on
+ * the number of valves is derived from VALUE_COUNT here so the budget follows the zone count.
+ * Stack sizes are in bytes (ESP-IDF StackType_t is a byte).
+ */
+#define SPRINKLER_TASK_STACKSIZE        (4 * 1024)
+#define ACTUATION_TASK_STACKSIZE        (3 * 1024)
+/* Room for an open and a close of every valve, plus a system wide off */
+#define ACTUATION_QUEUE_LENGTH          (2 * VALUE_COUNT + 2)
+#define SUPERVISOR_TASK_STACKSIZE       (3 * 1024)
+#define SUPERVISOR_QUEUE_LENGTH         8
+
+#define RAM_BUDGET_TASK_BYTES(stack)            ((stack) + sizeof(StaticTask_t))
+#define RAM_BUDGET_QUEUE_BYTES(length, item)    (((length) * (item)) + sizeof(StaticQueue_t))
+
+#ifdef CONFIG_SPRINKLER_POWER_MANAGEMENT
+#define SPRINKLER_PM_RAM_BYTES          sizeof(StaticTimer_t)
+#else
+#define SPRINKLER_PM_RAM_BYTES          0
+#endif
+
+#ifdef CONFIG_SPRINKLER_JITTER_STATS
+#define SPRINKLER_JITTER_RAM_BYTES      sizeof(StaticTimer_t)
+#else
+#define SPRINKLER_JITTER_RAM_BYTES      0
+#endif
+
+/* Everything allocated by our own code, checked against CONFIG_SPRINKLER_RAM_BUDGET at build time */
+#define SPRINKLER_RAM_TASK_BYTES ( \
+    RAM_BUDGET_TASK_BYTES(SPRINKLER_TASK_STACKSIZE) + \
+    RAM_BUDGET_TASK_BYTES(ACTUATION_TASK_STACKSIZE) + \
+    RAM_BUDGET_TASK_BYTES(SUPERVISOR_TASK_STACKSIZE))
+#define SPRINKLER_RAM_QUEUE_BYTES ( \
+    RAM_BUDGET_QUEUE_BYTES(ACTUATION_QUEUE_LENGTH, sizeof(valve_cmd_t)) + \
+    RAM_BUDGET_QUEUE_BYTES(SUPERVISOR_QUEUE_LENGTH, sizeof(link_event_t)))
+#define SPRINKLER_RAM_OTHER_BYTES ( \
+    sizeof(StaticSemaphore_t) + \
+    2 * sizeof(StaticTimer_t) + \
+    SPRINKLER_JITTER_RAM_BYTES + \
+    SPRINKLER_PM_RAM_BYTES)
+#define SPRINKLER_RAM_BYTES (SPRINKLER_RAM_TASK_BYTES + SPRINKLER_RAM_QUEUE_BYTES + SPRINKLER_RAM_OTHER_BYTES)
+
+/*
+ * The computed budget, kept in the firmware image as the symbol sprinkler_ram_budget_info.
+ * ram_budget_report.py prints it from the ELF after every build. The layout is read by that
+ * script, keep the two in step.
+ */
+typedef struct {
+    uint32_t ram_bytes;
+    uint32_t budget_bytes;
+    uint32_t task_bytes;
+    uint32_t queue_bytes;
+    uint32_t other_bytes;
+    uint32_t valves;
+    uint32_t static_allocation;
+} ram_budget_info_t;
+
+extern const volatile ram_budget_info_t sprinkler_ram_budget_info;
+
+/**
+ * @brief Add a task to the run-time report. The table is not locked: register from the HomeKit
+ * task only, before ram_budget_start().
+ *
+ * @param name Name shown in the report
+ * @param task Task handle
+ * @param stack_bytes Stack size the task was created with
+ */
+void ram_budget_register_task(const char *name, TaskHandle_t task, uint32_t stack_bytes);
+
+/**
+ * @brief Record the final stack high-water mark of a task that is about to delete itself
+ *
+ * @param task Task handle
+ */
+void ram_budget_task_exiting(TaskHandle_t task);
+
+/**
+ * @brief Log the build-time budget and start the periodic run-time report
+ */
+void ram_budget_start(void);
+
+/**
+ * @brief Log the budget against the measured stack and heap high-water marks
+ */
+void ram_budget_report(void);
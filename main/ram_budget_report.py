@@ -0,0 +1,95 @@
+#!/usr/bin/env python
+#
+# Copyright (c) 2020 <Mark Buckaway> MIT License
+#
+# Print the RAM budget computed at compile time (ram_budget.h) from the built firmware.
+# Run after every build by the top level CMakeLists.txt:
+#
+#   python main/ram_budget_report.py build/sprinkler_controller.elf
+#
+# Only the standard library is used, the symbol is looked up in the ELF symbol table and its
+# contents read from the section it lives in.
+
+from __future__ import print_function
+
+import struct
+import sys
+
+SYMBOL = b'sprinkler_ram_budget_info'
+# ram_budget_info_t, seven uint32_t
+FIELDS = ('ram_bytes', 'budget_bytes', 'task_bytes', 'queue_bytes', 'other_bytes', 'valves', 'static_allocation')
+SHT_SYMTAB = 2
+SHT_NOBITS = 8
+
+
+def read_sections(data, is64, endian):
+    if is64:
+        shoff, = struct.unpack_from(endian + 'Q', data, 0x28)
+        shentsize, shnum = struct.unpack_from(endian + 'HH', data, 0x3A)
+        layout = endian + 'IIQQQQIIQQ'
+    else:
+        shoff, = struct.unpack_from(endian + 'I', data, 0x20)
+        shentsize, shnum = struct.unpack_from(endian + 'HH', data, 0x2E)
+        layout = endian + 'IIIIIIIIII'
+    sections = []
+    for index in range(shnum):
+        name, sh_type, flags, addr, offset, size, link, info, align, entsize = \
+            struct.unpack_from(layout, data, shoff + index * shentsize)
+        sections.append({'type': sh_type, 'addr': addr, 'offset': offset, 'size': size,
+                         'link': link, 'entsize': entsize})
+    return sections
+
+
+def find_symbol(data, sections, is64, endian):
+    for section in sections:
+        if section['type'] != SHT_SYMTAB:
+            continue
+        strtab = sections[section['link']]
+        for index in range(section['size'] // section['entsize']):
+            entry = section['offset'] + index * section['entsize']
+            if is64:
+                name, info, other, shndx, value, size = struct.unpack_from(endian + 'IBBHQQ', data, entry)
+            else:
+                name, value, size, info, other, shndx = struct.unpack_from(endian + 'IIIBBH', data, entry)
+            start = strtab['offset'] + name
+            if data[start:data.index(b'\0', start)] == SYMBOL:
+                return value, size, shndx
+    return None
+
+
+def main(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:4] != b'\x7fELF':
+        print('RAM budget: %s is not an ELF file' % path)
+        return 1
+    is64 = data[4] == 2 or data[4:5] == b'\x02'
+    endian = '<' if (data[5] == 1 or data[5:6] == b'\x01') else '>'
+
+    sections = read_sections(data, is64, endian)
+    symbol = find_symbol(data, sections, is64, endian)
+    if symbol is None:
+        print('RAM budget: %s not found in %s' % (SYMBOL.decode(), path))
+        return 1
+    value, size, shndx = symbol
+    section = sections[shndx]
+    if section['type'] == SHT_NOBITS or size < 4 * len(FIELDS):
+        print('RAM budget: %s has no contents in %s' % (SYMBOL.decode(), path))
+        return 1
+    # Executables hold addresses, relocatable objects offsets into the section
+    start = section['offset'] + value - section['addr']
+    info = dict(zip(FIELDS, struct.unpack_from(endian + '%dI' % len(FIELDS), data, start)))
+
+    print('RAM budget: %d of %d bytes (%d%%) for %d valves, %s allocation' % (
+        info['ram_bytes'], info['budget_bytes'], info['ram_bytes'] * 100 // max(info['budget_bytes'], 1),
+        info['valves'], 'static' if info['static_allocation'] else 'heap'))
+    print('RAM budget: tasks %d, queues %d, other %d bytes, %d bytes headroom' % (
+        info['task_bytes'], info['queue_bytes'], info['other_bytes'], info['budget_bytes'] - info['ram_bytes']))
+    return 0
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        print('usage: %s firmware.elf' % sys.argv[0])
+        sys.exit(2)
+    sys.exit(main(sys.argv[1]))
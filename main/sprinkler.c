@@ -4,21 +4,86 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include "freertos/queue.h"
+#include "freertos/timers.h"
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include "driver/gpio.h"
+#include "soc/soc.h"
 //#include <iot_button.h>
 #include "sprinkler.h"
 #include "app_main.h"
 #include "homekit_states.h"
+#include "jitter.h"
+#include "ram_budget.h"
+#include "power.h"
+#include "valve_transition.h"
 
 
 static const char *TAG = "GDGPIO";
 
-static const long long unsigned int GPIO_OUTPUT_PIN_SEL = ((1ULL<<CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE1) | (1ULL<<CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE2) | (1ULL<<CONFIG_GPIO_OUTPUT_IO_RELAY_MASTER));
+/* Relay GPIO for each valve, indexed by ValveNo. Check that the GPIO pins are digital and not ADC! */
+static const int valve_gpio[VALUE_COUNT] = {
+    [VALUE_ZONE1] = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE1,
+    [VALUE_ZONE2] = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE2,
+    [VALUE_MASTER] = CONFIG_GPIO_OUTPUT_IO_RELAY_MASTER
+};
 //static const long long unsigned int GPIO_INPUT_PIN_SEL = ((1ULL<<CONFIG_GPIO_INPUT_IO_OPEN) | (1ULL<<CONFIG_GPIO_INPUT_IO_CLOSE));
 //static const uint16_t ESP_INTR_FLAG_DEFAULT = 0;
 
+/*
+ * Valve actuation runs on APP_CPU so it never competes with Wi-Fi, lwIP and the HAP crypto,
+ * which all live on PRO_CPU.
+ */
+static const uint16_t ACTUATION_TASK_PRIORITY = CONFIG_SPRINKLER_ACTUATION_TASK_PRIORITY;
+static const BaseType_t ACTUATION_TASK_CORE = APP_CPU_NUM;
+static const char *ACTUATION_TASK_NAME = "valve_actuator";
+
+static QueueHandle_t valve_cmd_queue = NULL;
+
+/* Set by the link supervisor while Wi-Fi is down, valves then run on local control only */
+static portMUX_TYPE offline_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool sprinkler_offline = false;
+static int64_t offline_since_us = 0;
+
+/* Coalescing and anti-chatter timing applied to every valve */
+static const valve_transition_config_t valve_transition_config = {
+    .settle_us = (int64_t)CONFIG_SPRINKLER_SETTLE_WINDOW_MS * 1000,
+    .min_dwell_us = (int64_t)CONFIG_SPRINKLER_MIN_DWELL_MS * 1000,
+};
+/* Statistics roll over once a day of uptime, the controller has no wall clock */
+static const TickType_t ACTUATION_STATS_DAY_TICKS = (TickType_t)24 * 60 * 60 * configTICK_RATE_HZ;
+
+/* Owned by the actuation task */
+static valve_transition_t valve_transitions[VALUE_COUNT];
+/* Last state queued for each valve, reported to HomeKit as Active before the relay follows */
+static volatile uint8_t valve_target[VALUE_COUNT];
+
+static portMUX_TYPE actuation_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static sprinkler_actuation_stats_t actuation_stats;
+static uint32_t latency_count = 0;
+static int64_t latency_total_us = 0;
+
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+static StackType_t actuation_task_stack[ACTUATION_TASK_STACKSIZE];
+static StaticTask_t actuation_task_buffer;
+static uint8_t valve_cmd_queue_storage[ACTUATION_QUEUE_LENGTH * sizeof(valve_cmd_t)];
+static StaticQueue_t valve_cmd_queue_buffer;
+static StaticTimer_t actuation_stats_timer_buffer;
+#endif
+
+/**
+ * @brief Map a valve number to its relay GPIO. Unknown valves map to zone 1.
+ */
+static int valve_gpio_port(u_int8_t valveno)
+{
+    if (valveno >= VALUE_COUNT)
+    {
+        valveno = VALUE_ZONE1;
+    }
+    return valve_gpio[valveno];
+}
+
 /**
  * @brief Set the valve state (on/off)
  * 
@@ -28,24 +93,15 @@ static const long long unsigned int GPIO_OUTPUT_PIN_SEL = ((1ULL<<CONFIG_GPIO_OU
 void set_valve_state(u_int8_t valveno, u_int8_t active)
 {
     ESP_LOGI(TAG, "Enabling relay %d...", valveno);
-    // Check that the GPIO pin is a digital and not ADC!
-    int gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE1;
-    switch (valveno)
-    {
-        case VALUE_ZONE1:
-            gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE1;
-            break;
-        case VALUE_ZONE2:
-            gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE2;
-            break;
-        case VALUE_MASTER:
-            gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_MASTER;
-            break;
-        default:
-            gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE1;
-            break;
-    }
+    int gpio_port = valve_gpio_port(valveno);
+#ifdef CONFIG_SPRINKLER_POWER_MANAGEMENT
+    /* The relay pins are held so they keep their level through light sleep */
+    gpio_hold_dis(gpio_port);
+    gpio_set_level(gpio_port, active);
+    gpio_hold_en(gpio_port);
+#else
     gpio_set_level(gpio_port, active);
+#endif
 }
 
 /**
@@ -57,26 +113,341 @@ void set_valve_state(u_int8_t valveno, u_int8_t active)
 u_int8_t get_valve_state(u_int8_t valveno)
 {
     ESP_LOGI(TAG, "Reading relay %d...", valveno);
-    // Check that the GPIO pin is a digital and not ADC!
-    int gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE1;
-    switch (valveno)
+    return gpio_get_level(valve_gpio_port(valveno))?ACTIVETYPE_ACTIVE:ACTIVETYPE_INACTIVE;
+}
+
+
+/**
+ * @brief Queue a valve state change for the actuation task
+ * 
+ * @param valveno Valve number (ValveNo type)
+ * @param active Requested valve state
+ * @return true if the command was queued
+ */
+bool sprinkler_request_valve_state(uint8_t valveno, uint8_t active)
+{
+    if (valveno >= VALUE_COUNT)
+    {
+        ESP_LOGE(TAG, "Unknown relay %d", valveno);
+        return false;
+    }
+    valve_cmd_t cmd = {
+        .valveno = valveno,
+        .active = active,
+        .queued_us = esp_timer_get_time()
+    };
+    if (valve_cmd_queue == NULL || xQueueSend(valve_cmd_queue, &cmd, 0) != pdTRUE)
+    {
+        ESP_LOGE(TAG, "Unable to queue command for relay %d", valveno);
+        return false;
+    }
+    valve_target[valveno] = active;
+    return true;
+}
+
+/**
+ * @brief Get the state last requested for a valve. The relay may still be settling.
+ * 
+ * @param valveno Valve number (ValveNo type)
+ * @return uint8_t Requested state (ActiveType)
+ */
+uint8_t sprinkler_get_target_state(uint8_t valveno)
+{
+    return (valveno < VALUE_COUNT) ? valve_target[valveno] : ACTIVETYPE_INACTIVE;
+}
+
+/**
+ * @brief Mark the controller offline or back online
+ * 
+ * @param offline true while HomeKit cannot reach the controller
+ */
+void sprinkler_set_offline(bool offline)
+{
+    int64_t now_us = esp_timer_get_time();
+    portENTER_CRITICAL(&offline_lock);
+    if (offline && !sprinkler_offline)
+    {
+        offline_since_us = now_us;
+    }
+    sprinkler_offline = offline;
+    portEXIT_CRITICAL(&offline_lock);
+}
+
+/**
+ * @brief Copy today's relay actuation statistics
+ * 
+ * @param stats Filled with the statistics
+ */
+void sprinkler_get_actuation_stats(sprinkler_actuation_stats_t *stats)
+{
+    portENTER_CRITICAL(&actuation_stats_lock);
+    *stats = actuation_stats;
+    portEXIT_CRITICAL(&actuation_stats_lock);
+}
+
+static void sprinkler_actuation_report(const sprinkler_actuation_stats_t *stats)
+{
+    ESP_LOGI(TAG, "relay transitions today: %u requested, %u actuated, %u saved (%u yesterday)",
+             stats->requested, stats->actuations, stats->saved, stats->saved_yesterday);
+    ESP_LOGI(TAG, "added command latency: avg %ums max %ums", stats->latency_avg_ms, stats->latency_max_ms);
+    if (stats->forced)
+    {
+        ESP_LOGW(TAG, "relays closed by the offline failsafe today: %u", stats->forced);
+    }
+}
+
+/**
+ * @brief Start a new day of actuation statistics. Runs on the FreeRTOS timer task, so the
+ * logging stays out of the actuation task.
+ */
+static void sprinkler_actuation_rollover_cb(TimerHandle_t timer)
+{
+    sprinkler_actuation_stats_t stats;
+    portENTER_CRITICAL(&actuation_stats_lock);
+    stats = actuation_stats;
+    memset(&actuation_stats, 0, sizeof(actuation_stats));
+    actuation_stats.saved_yesterday = stats.saved;
+    latency_count = 0;
+    latency_total_us = 0;
+    portEXIT_CRITICAL(&actuation_stats_lock);
+    sprinkler_actuation_report(&stats);
+}
+
+/**
+ * @brief Record a requested transition and, if the relay moved, its added latency
+ */
+static void sprinkler_actuation_count(bool requested, bool actuated, int64_t latency_us)
+{
+    portENTER_CRITICAL(&actuation_stats_lock);
+    if (requested)
+    {
+        actuation_stats.requested++;
+    }
+    if (actuated)
+    {
+        uint32_t latency_ms = (uint32_t)(latency_us / 1000);
+        actuation_stats.actuations++;
+        latency_count++;
+        latency_total_us += latency_us;
+        actuation_stats.latency_avg_ms = (uint32_t)(latency_total_us / latency_count / 1000);
+        if (latency_ms > actuation_stats.latency_max_ms)
+        {
+            actuation_stats.latency_max_ms = latency_ms;
+        }
+    }
+    actuation_stats.saved = (actuation_stats.requested > actuation_stats.actuations) ?
+                            actuation_stats.requested - actuation_stats.actuations : 0;
+    portEXIT_CRITICAL(&actuation_stats_lock);
+}
+
+/**
+ * @brief Record a relay closed by the offline failsafe. Kept apart from the HomeKit requests, it
+ * adds no latency sample.
+ */
+static void sprinkler_actuation_count_forced(void)
+{
+    portENTER_CRITICAL(&actuation_stats_lock);
+    actuation_stats.forced++;
+    portEXIT_CRITICAL(&actuation_stats_lock);
+}
+
+/**
+ * @brief Switch the relays of every valve whose pending command is due. In Use is reported to
+ * HomeKit here, once the relay has actually switched.
+ */
+static void sprinkler_run_transitions(int64_t now_us)
+{
+    for (int valveno = 0; valveno < VALUE_COUNT; valveno++)
+    {
+        valve_transition_t *vt = &valve_transitions[valveno];
+        int64_t latency_us = 0;
+        if (valve_transition_run(vt, &valve_transition_config, now_us, &latency_us))
+        {
+            set_valve_state(valveno, vt->relay);
+            sprinkler_actuation_count(false, true, latency_us);
+            valve_inuse_update(valveno, vt->relay ? INUSE_INUSE : INUSE_NOTINUSE);
+        }
+    }
+}
+
+/**
+ * @brief Earliest time a pending valve command is due, INT64_MAX if none
+ */
+static int64_t sprinkler_next_transition_us(void)
+{
+    int64_t due_us = INT64_MAX;
+    for (int valveno = 0; valveno < VALUE_COUNT; valveno++)
+    {
+        int64_t valve_due_us = valve_transition_due_us(&valve_transitions[valveno], &valve_transition_config);
+        if (valve_due_us < due_us)
+        {
+            due_us = valve_due_us;
+        }
+    }
+    return due_us;
+}
+
+#if CONFIG_SPRINKLER_OFFLINE_MAX_RUN > 0
+/**
+ * @brief Time the link went down, or -1 while online
+ */
+static int64_t sprinkler_offline_since_us(void)
+{
+    portENTER_CRITICAL(&offline_lock);
+    int64_t since_us = sprinkler_offline ? offline_since_us : -1;
+    portEXIT_CRITICAL(&offline_lock);
+    return since_us;
+}
+
+/**
+ * @brief Close any valve that has run unattended for longer than the offline limit, counted
+ * from when the link went down or from when the valve opened, whichever is later. Nobody can
+ * turn it off from HomeKit while the link is down.
+ */
+static void sprinkler_offline_failsafe(int64_t went_offline_us, int64_t now_us)
+{
+    const int64_t max_run_us = (int64_t)CONFIG_SPRINKLER_OFFLINE_MAX_RUN * 60 * 1000000;
+    for (int valveno = 0; valveno < VALUE_COUNT; valveno++)
+    {
+        valve_transition_t *vt = &valve_transitions[valveno];
+        int64_t unattended_since_us = (vt->last_change_us > went_offline_us) ? vt->last_change_us : went_offline_us;
+        if (vt->relay == ACTIVETYPE_ACTIVE && now_us - unattended_since_us > max_run_us)
+        {
+            ESP_LOGW(TAG, "Offline for too long, closing relay %d", valveno);
+            valve_target[valveno] = ACTIVETYPE_INACTIVE;
+            if (valve_transition_force(vt, ACTIVETYPE_INACTIVE, now_us))
+            {
+                set_valve_state(valveno, ACTIVETYPE_INACTIVE);
+                sprinkler_actuation_count_forced();
+            }
+            valve_active_update(valveno, ACTIVETYPE_INACTIVE);
+            valve_inuse_update(valveno, INUSE_NOTINUSE);
+        }
+    }
+}
+#endif
+
+/**
+ * @brief Valve actuation task. Feeds the queued valve commands to the per-valve transition
+ * state machines, switches the relays when their settle window and dwell time allow, and wakes
+ * once every control period for timed work. Each periodic wakeup is measured against its
+ * scheduled release time so the scheduling jitter can be compared with and without pairing load.
+ * The task only records samples, all reporting runs on the FreeRTOS timer task.
+ */
+static void sprinkler_actuation_task(void *p)
+{
+    const TickType_t period = pdMS_TO_TICKS(CONFIG_SPRINKLER_CONTROL_PERIOD_MS);
+    const int64_t period_us = (int64_t)period * portTICK_PERIOD_MS * 1000;
+    const int64_t tick_us = (int64_t)portTICK_PERIOD_MS * 1000;
+    valve_cmd_t cmd;
+
+    for (int valveno = 0; valveno < VALUE_COUNT; valveno++)
+    {
+        valve_transition_init(&valve_transitions[valveno], get_valve_state(valveno));
+        valve_target[valveno] = valve_transitions[valveno].relay;
+    }
+
+    /* Start on a tick boundary so the scheduled release times line up with the tick interrupts */
+    vTaskDelay(1);
+    TickType_t next_wake = xTaskGetTickCount() + period;
+    int64_t start_us = esp_timer_get_time();
+    /* Time each periodic wakeup is due, advanced in step with next_wake */
+    int64_t release_us = start_us + period_us;
+
+    ESP_LOGI(TAG, "Actuation task running on core %d", xPortGetCoreID());
+    for (;;)
     {
-        case VALUE_ZONE1:
-            gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE1;
-            break;
-        case VALUE_ZONE2:
-            gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE2;
-            break;
-        case VALUE_MASTER:
-            gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_MASTER;
-            break;
-        default:
-            gpio_port = CONFIG_GPIO_OUTPUT_IO_RELAY_ZONE1;
-            break;
+        TickType_t now = xTaskGetTickCount();
+        TickType_t wait = ((int32_t)(next_wake - now) > 0) ? (next_wake - now) : 0;
+        int64_t due_us = sprinkler_next_transition_us();
+        if (due_us != INT64_MAX)
+        {
+            /* Round up so we never wake before the transition is due */
+            int64_t remaining_us = due_us - esp_timer_get_time();
+            TickType_t due_wait = (remaining_us > 0) ? (TickType_t)((remaining_us + tick_us - 1) / tick_us) : 0;
+            if (due_wait < wait)
+            {
+                wait = due_wait;
+            }
+        }
+
+        if (xQueueReceive(valve_cmd_queue, &cmd, wait) == pdTRUE)
+        {
+            int64_t received_us = esp_timer_get_time();
+#ifdef CONFIG_SPRINKLER_JITTER_STATS
+            jitter_record_command(received_us - cmd.queued_us);
+#endif
+            if (cmd.valveno < VALUE_COUNT)
+            {
+                bool requested = valve_transition_request(&valve_transitions[cmd.valveno], cmd.active, cmd.queued_us);
+                sprinkler_actuation_count(requested, false, 0);
+            }
+            sprinkler_run_transitions(received_us);
+        }
+        else
+        {
+            sprinkler_run_transitions(esp_timer_get_time());
+        }
+
+        if ((int32_t)(xTaskGetTickCount() - next_wake) < 0)
+        {
+            continue;
+        }
+
+        /* Control period elapsed */
+        int64_t now_us = esp_timer_get_time();
+        power_record_wakeup(POWER_WAKE_TIMER);
+#ifdef CONFIG_SPRINKLER_JITTER_STATS
+        jitter_record_wakeup(now_us - release_us);
+#endif
+#if CONFIG_SPRINKLER_OFFLINE_MAX_RUN > 0
+        int64_t went_offline_us = sprinkler_offline_since_us();
+        if (went_offline_us >= 0)
+        {
+            sprinkler_offline_failsafe(went_offline_us, now_us);
+        }
+#endif
+        release_us += period_us;
+        next_wake += period;
     }
-    return gpio_get_level(gpio_port)?ACTIVETYPE_ACTIVE:ACTIVETYPE_INACTIVE;
 }
 
+/**
+ * @brief Start the valve actuation task pinned to APP_CPU
+ */
+void start_sprinkler(void)
+{
+    TaskHandle_t task = NULL;
+
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+    valve_cmd_queue = xQueueCreateStatic(ACTUATION_QUEUE_LENGTH, sizeof(valve_cmd_t),
+                                         valve_cmd_queue_storage, &valve_cmd_queue_buffer);
+    task = xTaskCreateStaticPinnedToCore(sprinkler_actuation_task, ACTUATION_TASK_NAME, ACTUATION_TASK_STACKSIZE, NULL,
+                                         ACTUATION_TASK_PRIORITY, actuation_task_stack, &actuation_task_buffer,
+                                         ACTUATION_TASK_CORE);
+#else
+    valve_cmd_queue = xQueueCreate(ACTUATION_QUEUE_LENGTH, sizeof(valve_cmd_t));
+    xTaskCreatePinnedToCore(sprinkler_actuation_task, ACTUATION_TASK_NAME, ACTUATION_TASK_STACKSIZE, NULL,
+                            ACTUATION_TASK_PRIORITY, &task, ACTUATION_TASK_CORE);
+#endif
+    ram_budget_register_task(ACTUATION_TASK_NAME, task, ACTUATION_TASK_STACKSIZE);
+
+    /* Reports run on the timer task, the actuation task only records samples */
+    TimerHandle_t timer;
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+    timer = xTimerCreateStatic("actuation_stats", ACTUATION_STATS_DAY_TICKS, pdTRUE, NULL,
+                               sprinkler_actuation_rollover_cb, &actuation_stats_timer_buffer);
+#else
+    timer = xTimerCreate("actuation_stats", ACTUATION_STATS_DAY_TICKS, pdTRUE, NULL, sprinkler_actuation_rollover_cb);
+#endif
+    if (timer == NULL || xTimerStart(timer, 0) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Unable to start the actuation statistics timer");
+    }
+#ifdef CONFIG_SPRINKLER_JITTER_STATS
+    jitter_start();
+#endif
+}
 
 /**
  * @brief Setup the GPIO, ISR, and event queue
@@ -84,15 +455,28 @@ u_int8_t get_valve_state(u_int8_t valveno)
 
 void sprinkler_setup(void)
 {
+    uint64_t pin_bit_mask = 0;
+    for (int valveno = 0; valveno < VALUE_COUNT; valveno++)
+    {
+        pin_bit_mask |= (1ULL << valve_gpio[valveno]);
+    }
+
+    /* Input is enabled as well so get_valve_state() can read the relay state back */
     gpio_config_t io_out_conf = {
         .intr_type = GPIO_PIN_INTR_DISABLE,
-        .mode = GPIO_MODE_OUTPUT,
-        .pin_bit_mask = GPIO_OUTPUT_PIN_SEL,
+        .mode = GPIO_MODE_INPUT_OUTPUT,
+        .pin_bit_mask = pin_bit_mask,
         .pull_down_en = 0,
         .pull_up_en = 0
     };
 
     gpio_config(&io_out_conf);
+#ifdef CONFIG_SPRINKLER_POWER_MANAGEMENT
+    for (int valveno = 0; valveno < VALUE_COUNT; valveno++)
+    {
+        gpio_hold_en(valve_gpio[valveno]);
+    }
+#endif
 
     ESP_LOGI(TAG, "Sprinkler GPIO configured");
 }
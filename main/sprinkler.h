@@ -2,16 +2,80 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 enum ValveNo {
     VALUE_ZONE1,
     VALUE_ZONE2,
-    VALUE_MASTER
+    VALUE_MASTER,
+    VALUE_COUNT
 };
 
+/* The irrigation system tracks the valves in a 32 bit mask */
+#define SPRINKLER_MAX_VALVES 32
+_Static_assert(VALUE_COUNT <= SPRINKLER_MAX_VALVES, "Too many valves for the irrigation system");
+
+/**
+ * Valve command queued for the actuation task
+ */
+typedef struct {
+    uint8_t valveno;
+    uint8_t active;
+    int64_t queued_us;
+} valve_cmd_t;
+
+/**
+ * Relay actuation statistics for the current day of uptime
+ */
+typedef struct {
+    uint32_t requested;                 /* Transitions requested by HomeKit, one relay actuation each without coalescing */
+    uint32_t actuations;                /* Relay transitions actually made */
+    uint32_t saved;                     /* Actuations avoided by coalescing */
+    uint32_t saved_yesterday;           /* Actuations avoided the previous day */
+    uint32_t latency_avg_ms;            /* Delay added by the settle window and dwell time */
+    uint32_t latency_max_ms;
+    uint32_t forced;                    /* Relays closed by the offline failsafe, not in the figures above */
+} sprinkler_actuation_stats_t;
+
 void sprinkler_setup(void);
+
+/**
+ * @brief Start the valve actuation task (pinned to APP_CPU)
+ */
 void start_sprinkler(void);
 
+/**
+ * @brief Queue a valve state change for the actuation task
+ * 
+ * @param valveno Valve number (ValveNo type)
+ * @param active Requested valve state
+ * @return true if the command was queued
+ */
+bool sprinkler_request_valve_state(uint8_t valveno, uint8_t active);
+
+/**
+ * @brief Get the state last requested for a valve. The relay may still be settling.
+ * 
+ * @param valveno Valve number (ValveNo type)
+ * @return uint8_t Requested state (ActiveType)
+ */
+uint8_t sprinkler_get_target_state(uint8_t valveno);
+
+/**
+ * @brief Copy today's relay actuation statistics
+ * 
+ * @param stats Filled with the statistics
+ */
+void sprinkler_get_actuation_stats(sprinkler_actuation_stats_t *stats);
+
+/**
+ * @brief Mark the controller offline or back online. While offline, valves keep running on
+ * local control and are closed after CONFIG_SPRINKLER_OFFLINE_MAX_RUN minutes.
+ * 
+ * @param offline true while HomeKit cannot reach the controller
+ */
+void sprinkler_set_offline(bool offline);
+
 /**
  * @brief Set the value state (on/off)
  * 
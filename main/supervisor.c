@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2020 <Mark Buckaway> MIT License
+ *
+ * Wi-Fi/HAP link supervisor task
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "freertos/queue.h"
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <esp_netif.h>
+#include <esp_system.h>
+#include <mdns.h>
+#include "soc/soc.h"
+
+#include "supervisor.h"
+#include "sprinkler.h"
+#include "ram_budget.h"
+
+static const char *TAG = "SUPERVISOR";
+
+/* Networking task, lives on PRO_CPU with Wi-Fi and HAP */
+static const uint16_t SUPERVISOR_TASK_PRIORITY = 4;
+static const BaseType_t SUPERVISOR_TASK_CORE = PRO_CPU_NUM;
+static const char *SUPERVISOR_TASK_NAME = "link_supervisor";
+/* Upper bound on a single wait so the millisecond clock is sampled regularly */
+static const uint32_t SUPERVISOR_MAX_WAIT_MS = 60 * 1000;
+
+static QueueHandle_t supervisor_queue = NULL;
+static link_supervisor_t supervisor;
+
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+static StackType_t supervisor_task_stack[SUPERVISOR_TASK_STACKSIZE];
+static StaticTask_t supervisor_task_buffer;
+static uint8_t supervisor_queue_storage[SUPERVISOR_QUEUE_LENGTH * sizeof(link_event_t)];
+static StaticQueue_t supervisor_queue_buffer;
+#endif
+
+/* BSSID and channel of the AP we last associated with, written by the Wi-Fi event handler */
+static portMUX_TYPE cached_ap_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t cached_bssid[6];
+static uint8_t cached_channel = 0;
+/* Set while the station config is pinned to the cached AP, only used by the supervisor task */
+static bool bssid_pinned = false;
+/* HAP category, the TXT item re-sent to trigger an mDNS announcement */
+static char announce_category[4];
+
+static uint32_t supervisor_now_ms(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static void supervisor_report(void)
+{
+    const link_supervisor_stats_t *stats = &supervisor.stats;
+    if (stats->reconnects == 0)
+    {
+        ESP_LOGI(TAG, "no reconnects, %u attempts", stats->attempts);
+        return;
+    }
+    ESP_LOGI(TAG, "reconnects: %u in %u attempts, outage last %ums min %ums avg %ums max %ums, %u re-announcements",
+             stats->reconnects, stats->attempts, stats->last_ms, stats->min_ms,
+             (uint32_t)(stats->total_ms / stats->reconnects), stats->max_ms, stats->reannounces);
+}
+
+static void supervisor_connect(void *ctx, bool use_cached_ap)
+{
+    wifi_config_t wifi_config;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to read the Wi-Fi station config");
+        return;
+    }
+
+    /* Pinning the BSSID and channel skips the full scan, which is most of the reconnect time */
+    portENTER_CRITICAL(&cached_ap_lock);
+    wifi_config.sta.bssid_set = use_cached_ap;
+    wifi_config.sta.channel = use_cached_ap ? cached_channel : 0;
+    memcpy(wifi_config.sta.bssid, cached_bssid, sizeof(wifi_config.sta.bssid));
+    portEXIT_CRITICAL(&cached_ap_lock);
+
+    ESP_LOGI(TAG, "Reconnect attempt %u (%s)", supervisor.attempt, use_cached_ap ? "cached AP" : "full scan");
+    /* Wi-Fi storage is RAM (see supervisor_start), so this does not write flash */
+    if (esp_wifi_set_config(WIFI_IF_STA, &wifi_config) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to set the Wi-Fi station config");
+    }
+    bssid_pinned = use_cached_ap;
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "esp_wifi_connect failed: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * @brief Drop the cached AP from the station config once connected, so later reconnects by the
+ * driver itself are not tied to an AP that may have moved
+ */
+static void supervisor_unpin_ap(void)
+{
+    wifi_config_t wifi_config;
+    if (!bssid_pinned || esp_wifi_get_config(WIFI_IF_STA, &wifi_config) != ESP_OK)
+    {
+        return;
+    }
+    wifi_config.sta.bssid_set = false;
+    wifi_config.sta.channel = 0;
+    if (esp_wifi_set_config(WIFI_IF_STA, &wifi_config) == ESP_OK)
+    {
+        bssid_pinned = false;
+    }
+}
+
+static void supervisor_announce(void *ctx)
+{
+    /* Setting a TXT item, even to its current value, makes mDNS announce the service again.
+     * The configuration number is left alone, bumping it makes every controller reload the
+     * accessory database. */
+    ESP_LOGI(TAG, "Re-announcing the accessory");
+    esp_err_t err = mdns_service_txt_item_set("_hap", "_tcp", "ci", announce_category);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Unable to re-announce the accessory: %s", esp_err_to_name(err));
+    }
+}
+
+static void supervisor_link_changed(void *ctx, bool up)
+{
+    if (up)
+    {
+        ESP_LOGI(TAG, "Link restored after %ums", supervisor.stats.last_ms);
+        supervisor_unpin_ap();
+        supervisor_report();
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Link lost, valves keep running on local control");
+    }
+    sprinkler_set_offline(!up);
+}
+
+static uint32_t supervisor_random(void *ctx)
+{
+    return esp_random();
+}
+
+static void supervisor_wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event, void *data)
+{
+    if (event_base == WIFI_EVENT)
+    {
+        switch (event)
+        {
+            case WIFI_EVENT_STA_CONNECTED : {
+                wifi_event_sta_connected_t *connected = (wifi_event_sta_connected_t *)data;
+                portENTER_CRITICAL(&cached_ap_lock);
+                memcpy(cached_bssid, connected->bssid, sizeof(cached_bssid));
+                cached_channel = connected->channel;
+                portEXIT_CRITICAL(&cached_ap_lock);
+                supervisor_post_event(LINK_EVENT_CONNECTED);
+                break;
+            }
+            case WIFI_EVENT_STA_DISCONNECTED :
+                supervisor_post_event(LINK_EVENT_DISCONNECTED);
+                break;
+            default:
+                break;
+        }
+    }
+    else if (event_base == IP_EVENT)
+    {
+        switch (event)
+        {
+            case IP_EVENT_STA_GOT_IP :
+                supervisor_post_event(LINK_EVENT_GOT_IP);
+                break;
+            case IP_EVENT_STA_LOST_IP :
+                supervisor_post_event(LINK_EVENT_LOST_IP);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void supervisor_post_event(link_event_type_t type)
+{
+    link_event_t event = {
+        .type = type,
+        .time_ms = supervisor_now_ms()
+    };
+    if (supervisor_queue == NULL)
+    {
+        return;
+    }
+    if (xQueueSend(supervisor_queue, &event, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Event queue full, dropped event %d", type);
+    }
+}
+
+/**
+ * @brief Supervisor task. Feeds the Wi-Fi, IP and HAP events to the state machine and ticks it
+ * when a reconnect or re-announce timer is due.
+ */
+static void supervisor_task(void *p)
+{
+    link_event_t event;
+
+    for (;;)
+    {
+        uint32_t timeout = link_supervisor_next_timeout(&supervisor, supervisor_now_ms());
+        if (timeout > SUPERVISOR_MAX_WAIT_MS)
+        {
+            timeout = SUPERVISOR_MAX_WAIT_MS;
+        }
+        if (xQueueReceive(supervisor_queue, &event, pdMS_TO_TICKS(timeout) + 1) != pdTRUE)
+        {
+            event.type = LINK_EVENT_TICK;
+            event.time_ms = supervisor_now_ms();
+        }
+        link_supervisor_handle_event(&supervisor, &event);
+    }
+}
+
+void supervisor_start(uint8_t category)
+{
+    const link_supervisor_config_t config = {
+        .backoff_min_ms = CONFIG_SPRINKLER_RECONNECT_MIN_MS,
+        .backoff_max_ms = CONFIG_SPRINKLER_RECONNECT_MAX_MS,
+        .connect_timeout_ms = CONFIG_SPRINKLER_CONNECT_TIMEOUT_MS,
+        .fast_attempts = CONFIG_SPRINKLER_FAST_RECONNECT_ATTEMPTS,
+        .mdns_silence_ms = CONFIG_SPRINKLER_MDNS_SILENCE * 1000,
+        .mdns_silence_max_ms = CONFIG_SPRINKLER_MDNS_SILENCE_MAX * 1000,
+    };
+    const link_supervisor_ops_t ops = {
+        .connect = supervisor_connect,
+        .announce = supervisor_announce,
+        .link_changed = supervisor_link_changed,
+        .random = supervisor_random,
+        .ctx = NULL,
+    };
+    TaskHandle_t task = NULL;
+
+    link_supervisor_init(&supervisor, &config, &ops, supervisor_now_ms());
+    snprintf(announce_category, sizeof(announce_category), "%u", category);
+
+    /* Reconnects rewrite the station config, keep that out of NVS */
+    esp_wifi_set_storage(WIFI_STORAGE_RAM);
+
+    /* Wi-Fi is already up, so cache the AP it is connected to */
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+    {
+        memcpy(cached_bssid, ap_info.bssid, sizeof(cached_bssid));
+        cached_channel = ap_info.primary;
+    }
+    link_supervisor_set_cached_ap(&supervisor, true);
+
+#ifdef CONFIG_SPRINKLER_STATIC_ALLOCATION
+    supervisor_queue = xQueueCreateStatic(SUPERVISOR_QUEUE_LENGTH, sizeof(link_event_t),
+                                          supervisor_queue_storage, &supervisor_queue_buffer);
+    task = xTaskCreateStaticPinnedToCore(supervisor_task, SUPERVISOR_TASK_NAME, SUPERVISOR_TASK_STACKSIZE, NULL,
+                                         SUPERVISOR_TASK_PRIORITY, supervisor_task_stack, &supervisor_task_buffer,
+                                         SUPERVISOR_TASK_CORE);
+#else
+    supervisor_queue = xQueueCreate(SUPERVISOR_QUEUE_LENGTH, sizeof(link_event_t));
+    xTaskCreatePinnedToCore(supervisor_task, SUPERVISOR_TASK_NAME, SUPERVISOR_TASK_STACKSIZE, NULL,
+                            SUPERVISOR_TASK_PRIORITY, &task, SUPERVISOR_TASK_CORE);
+#endif
+    ram_budget_register_task(SUPERVISOR_TASK_NAME, task, SUPERVISOR_TASK_STACKSIZE);
+
+    esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &supervisor_wifi_event_handler, NULL);
+    esp_event_handler_register(IP_EVENT, ESP_EVENT_ANY_ID, &supervisor_wifi_event_handler, NULL);
+    ESP_LOGI(TAG, "Link supervisor started");
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "link_supervisor.h"
+
+/**
+ * @brief Start the link supervisor task (pinned to PRO_CPU). Call once Wi-Fi is connected and HAP is running.
+ *
+ * @param category HAP accessory category, re-sent in the mDNS TXT record to re-announce the accessory
+ */
+void supervisor_start(uint8_t category);
+
+/**
+ * @brief Post an event to the supervisor. Used by the Wi-Fi, IP and HAP event handlers, and
+ * usable as a simulated Wi-Fi event source.
+ *
+ * @param type Event type, timestamped on the way in
+ */
+void supervisor_post_event(link_event_type_t type);
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2020 <Mark Buckaway> MIT License
+ *
+ * Valve command coalescing and anti-chatter state machine
+ */
+
+#include <string.h>
+
+#include "valve_transition.h"
+
+/* Far enough in the past that the dwell time never delays the first transition */
+#define VALVE_TRANSITION_NEVER (INT64_MIN / 2)
+
+void valve_transition_init(valve_transition_t *vt, uint8_t relay)
+{
+    memset(vt, 0, sizeof(*vt));
+    vt->relay = relay;
+    vt->target = relay;
+    vt->last_change_us = VALVE_TRANSITION_NEVER;
+}
+
+bool valve_transition_request(valve_transition_t *vt, uint8_t active, int64_t now_us)
+{
+    bool changed = (active != vt->target);
+    vt->target = active;
+    if (!vt->pending)
+    {
+        vt->pending = true;
+        vt->first_request_us = now_us;
+    }
+    return changed;
+}
+
+int64_t valve_transition_due_us(const valve_transition_t *vt, const valve_transition_config_t *config)
+{
+    if (!vt->pending)
+    {
+        return INT64_MAX;
+    }
+    int64_t settled = vt->first_request_us + config->settle_us;
+    int64_t dwelled = vt->last_change_us + config->min_dwell_us;
+    /* Only the dwell time matters if the relay would actually move */
+    if (vt->target != vt->relay && dwelled > settled)
+    {
+        return dwelled;
+    }
+    return settled;
+}
+
+bool valve_transition_run(valve_transition_t *vt, const valve_transition_config_t *config,
+                          int64_t now_us, int64_t *latency_us)
+{
+    if (!vt->pending || now_us < valve_transition_due_us(vt, config))
+    {
+        return false;
+    }
+    vt->pending = false;
+    if (vt->target == vt->relay)
+    {
+        /* The burst cancelled itself out */
+        return false;
+    }
+    *latency_us = now_us - vt->first_request_us;
+    vt->relay = vt->target;
+    vt->last_change_us = now_us;
+    return true;
+}
+
+bool valve_transition_force(valve_transition_t *vt, uint8_t active, int64_t now_us)
+{
+    vt->target = active;
+    vt->pending = false;
+    if (vt->relay == active)
+    {
+        return false;
+    }
+    vt->relay = active;
+    vt->last_change_us = now_us;
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Per-valve transition state machine.
+ *
+ * Commands only move the target. The relay follows once the settle window that opened with
+ * the first command of a burst has passed and the relay has held its state for the minimum
+ * dwell time, so a burst of contradictory writes ends up as at most one net transition.
+ * Like link_supervisor.c this has no ESP-IDF dependencies, times are passed in.
+ */
+
+typedef struct {
+    int64_t settle_us;                  /* Commands within this window of the first are coalesced */
+    int64_t min_dwell_us;               /* Minimum time the relay holds a state */
+} valve_transition_config_t;
+
+typedef struct {
+    uint8_t relay;                      /* State the relay is in */
+    uint8_t target;                     /* State last requested */
+    bool pending;                       /* A command is waiting for its settle window */
+    int64_t first_request_us;           /* First command of the pending burst */
+    int64_t last_change_us;             /* Last relay transition */
+} valve_transition_t;
+
+/**
+ * @brief Initialise a valve in the given relay state, free to switch straight away
+ */
+void valve_transition_init(valve_transition_t *vt, uint8_t relay);
+
+/**
+ * @brief Record a requested state
+ *
+ * @return true if the request changes the target, i.e. it would have switched the relay on its own
+ */
+bool valve_transition_request(valve_transition_t *vt, uint8_t active, int64_t now_us);
+
+/**
+ * @brief Time at which the pending command can be applied, INT64_MAX if nothing is pending
+ */
+int64_t valve_transition_due_us(const valve_transition_t *vt, const valve_transition_config_t *config);
+
+/**
+ * @brief Apply the pending command if it is due
+ *
+ * @param latency_us Set to the delay added since the first command of the burst when the relay switches
+ * @return true if the relay must be switched to vt->relay
+ */
+bool valve_transition_run(valve_transition_t *vt, const valve_transition_config_t *config,
+                          int64_t now_us, int64_t *latency_us);
+
+/**
+ * @brief Switch straight away, ignoring the settle window and dwell time (failsafe use)
+ *
+ * @return true if the relay must be switched to vt->relay
+ */
+bool valve_transition_force(valve_transition_t *vt, uint8_t active, int64_t now_us);
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2020 <Mark Buckaway> MIT License
+ *
+ * Host test for the Wi-Fi/HAP link supervisor state machine. Drives it with scripted
+ * Wi-Fi, IP and controller events the way supervisor.c does on the device.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "link_supervisor.h"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define MAX_CONNECTS 32
+
+/* What the state machine asked the platform to do */
+typedef struct {
+    int connects;
+    bool cached[MAX_CONNECTS];
+    int announces;
+    int ups;
+    int downs;
+    uint32_t random_state;
+    bool random_zero;
+} fake_platform_t;
+
+static void fake_connect(void *ctx, bool use_cached_ap)
+{
+    fake_platform_t *fake = ctx;
+    if (fake->connects < MAX_CONNECTS)
+    {
+        fake->cached[fake->connects] = use_cached_ap;
+    }
+    fake->connects++;
+}
+
+static void fake_announce(void *ctx)
+{
+    fake_platform_t *fake = ctx;
+    fake->announces++;
+}
+
+static void fake_link_changed(void *ctx, bool up)
+{
+    fake_platform_t *fake = ctx;
+    if (up)
+    {
+        fake->ups++;
+    }
+    else
+    {
+        fake->downs++;
+    }
+}
+
+static uint32_t fake_random(void *ctx)
+{
+    fake_platform_t *fake = ctx;
+    if (fake->random_zero)
+    {
+        return 0;
+    }
+    fake->random_state = fake->random_state * 1664525 + 1013904223;
+    return fake->random_state;
+}
+
+static const link_supervisor_config_t test_config = {
+    .backoff_min_ms = 1000,
+    .backoff_max_ms = 8000,
+    .connect_timeout_ms = 5000,
+    .fast_attempts = 2,
+    .mdns_silence_ms = 600000,
+    .mdns_silence_max_ms = 2400000,
+};
+
+static void setup(link_supervisor_t *ls, fake_platform_t *fake, uint32_t now_ms)
+{
+    const link_supervisor_ops_t ops = {
+        .connect = fake_connect,
+        .announce = fake_announce,
+        .link_changed = fake_link_changed,
+        .random = fake_random,
+        .ctx = fake,
+    };
+    memset(fake, 0, sizeof(*fake));
+    fake->random_state = 12345;
+    link_supervisor_init(ls, &test_config, &ops, now_ms);
+    link_supervisor_set_cached_ap(ls, true);
+}
+
+static void send(link_supervisor_t *ls, link_event_type_t type, uint32_t time_ms)
+{
+    const link_event_t event = {
+        .type = type,
+        .time_ms = time_ms
+    };
+    link_supervisor_handle_event(ls, &event);
+}
+
+/* Tick at the next deadline, as the supervisor task does, and return the time */
+static uint32_t run_to_deadline(link_supervisor_t *ls, uint32_t now_ms)
+{
+    uint32_t timeout = link_supervisor_next_timeout(ls, now_ms);
+    CHECK(timeout != UINT32_MAX);
+    now_ms += timeout;
+    send(ls, LINK_EVENT_TICK, now_ms);
+    return now_ms;
+}
+
+/* Every retry delay lies in [backoff/2, backoff], the backoff doubling up to the cap */
+static void test_backoff_bounds(bool random_zero)
+{
+    link_supervisor_t ls;
+    fake_platform_t fake;
+    uint32_t now_ms = 1000;
+    uint32_t backoff_ms = test_config.backoff_min_ms;
+
+    setup(&ls, &fake, 0);
+    fake.random_zero = random_zero;
+    send(&ls, LINK_EVENT_DISCONNECTED, now_ms);
+    CHECK(ls.state == LINK_STATE_DOWN);
+    CHECK(fake.downs == 1);
+
+    for (int attempt = 1; attempt <= 8; attempt++)
+    {
+        uint32_t delay_ms = link_supervisor_next_timeout(&ls, now_ms);
+        CHECK(delay_ms >= backoff_ms / 2);
+        CHECK(delay_ms <= backoff_ms);
+        if (random_zero)
+        {
+            CHECK(delay_ms == backoff_ms / 2);
+        }
+
+        /* One tick short of the deadline does nothing */
+        send(&ls, LINK_EVENT_TICK, now_ms + delay_ms - 1);
+        CHECK(fake.connects == attempt - 1);
+
+        now_ms = run_to_deadline(&ls, now_ms);
+        CHECK(fake.connects == attempt);
+        CHECK(ls.state == LINK_STATE_CONNECTING);
+
+        /* The attempt fails */
+        now_ms += 200;
+        send(&ls, LINK_EVENT_DISCONNECTED, now_ms);
+        CHECK(ls.state == LINK_STATE_DOWN);
+        backoff_ms = (backoff_ms * 2 > test_config.backoff_max_ms) ? test_config.backoff_max_ms : backoff_ms * 2;
+    }
+    CHECK(ls.stats.attempts == 8);
+    CHECK(ls.stats.reconnects == 0);
+    CHECK(fake.downs == 1);
+    CHECK(fake.ups == 0);
+}
+
+/* An attempt that never gets an IP times out and is rescheduled */
+static void test_connect_timeout(void)
+{
+    link_supervisor_t ls;
+    fake_platform_t fake;
+    uint32_t now_ms = 1000;
+
+    setup(&ls, &fake, 0);
+    send(&ls, LINK_EVENT_DISCONNECTED, now_ms);
+    now_ms = run_to_deadline(&ls, now_ms);
+    send(&ls, LINK_EVENT_CONNECTED, now_ms + 100);
+    CHECK(ls.state == LINK_STATE_ASSOCIATED);
+    CHECK(link_supervisor_next_timeout(&ls, now_ms + 100) == test_config.connect_timeout_ms);
+
+    now_ms = run_to_deadline(&ls, now_ms + 100);
+    CHECK(ls.state == LINK_STATE_DOWN);
+    now_ms = run_to_deadline(&ls, now_ms);
+    CHECK(fake.connects == 2);
+}
+
+/* A late LOST_IP during a reconnect attempt neither fails it nor starts another one */
+static void test_lost_ip_during_attempt(void)
+{
+    link_supervisor_t ls;
+    fake_platform_t fake;
+    uint32_t now_ms = 1000;
+
+    setup(&ls, &fake, 0);
+    send(&ls, LINK_EVENT_DISCONNECTED, now_ms);
+    now_ms = run_to_deadline(&ls, now_ms);
+    CHECK(ls.state == LINK_STATE_CONNECTING);
+    uint32_t backoff_ms = ls.backoff_ms;
+    uint32_t deadline_ms = ls.attempt_deadline_ms;
+
+    send(&ls, LINK_EVENT_LOST_IP, now_ms + 100);
+    CHECK(ls.state == LINK_STATE_CONNECTING);
+    CHECK(ls.backoff_ms == backoff_ms);
+    CHECK(ls.attempt_deadline_ms == deadline_ms);
+    send(&ls, LINK_EVENT_TICK, now_ms + 200);
+    CHECK(fake.connects == 1);
+
+    send(&ls, LINK_EVENT_CONNECTED, now_ms + 300);
+    CHECK(ls.state == LINK_STATE_ASSOCIATED);
+    deadline_ms = ls.attempt_deadline_ms;
+    send(&ls, LINK_EVENT_LOST_IP, now_ms + 400);
+    CHECK(ls.state == LINK_STATE_ASSOCIATED);
+    CHECK(ls.backoff_ms == backoff_ms);
+    CHECK(ls.attempt_deadline_ms == deadline_ms);
+    send(&ls, LINK_EVENT_TICK, now_ms + 500);
+    CHECK(fake.connects == 1);
+
+    send(&ls, LINK_EVENT_GOT_IP, now_ms + 600);
+    CHECK(ls.state == LINK_STATE_UP);
+    CHECK(ls.stats.reconnects == 1);
+    CHECK(ls.stats.attempts == 1);
+
+    /* While down and waiting it changes nothing either */
+    send(&ls, LINK_EVENT_DISCONNECTED, now_ms + 1000);
+    CHECK(ls.state == LINK_STATE_DOWN);
+    uint32_t next_attempt_ms = ls.next_attempt_ms;
+    send(&ls, LINK_EVENT_LOST_IP, now_ms + 1100);
+    CHECK(ls.state == LINK_STATE_DOWN);
+    CHECK(ls.next_attempt_ms == next_attempt_ms);
+
+    /* While up it is the link going down */
+    setup(&ls, &fake, 0);
+    send(&ls, LINK_EVENT_LOST_IP, 1000);
+    CHECK(ls.state == LINK_STATE_DOWN);
+    CHECK(fake.downs == 1);
+}
+
+/* The first fast_attempts reuse the cached AP, later ones scan */
+static void test_cached_ap_fallback(void)
+{
+    link_supervisor_t ls;
+    fake_platform_t fake;
+    uint32_t now_ms = 1000;
+
+    setup(&ls, &fake, 0);
+    send(&ls, LINK_EVENT_DISCONNECTED, now_ms);
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+        now_ms = run_to_deadline(&ls, now_ms);
+        send(&ls, LINK_EVENT_DISCONNECTED, now_ms + 10);
+        now_ms += 10;
+    }
+    CHECK(fake.connects == 5);
+    CHECK(fake.cached[0] == true);
+    CHECK(fake.cached[1] == true);
+    CHECK(fake.cached[2] == false);
+    CHECK(fake.cached[3] == false);
+    CHECK(fake.cached[4] == false);
+
+    /* A new outage starts with the cached AP again */
+    now_ms = run_to_deadline(&ls, now_ms);
+    send(&ls, LINK_EVENT_CONNECTED, now_ms + 10);
+    send(&ls, LINK_EVENT_GOT_IP, now_ms + 20);
+    CHECK(ls.state == LINK_STATE_UP);
+    now_ms += 1000;
+    send(&ls, LINK_EVENT_DISCONNECTED, now_ms);
+    now_ms = run_to_deadline(&ls, now_ms);
+    CHECK(fake.connects == 7);
+    CHECK(fake.cached[6] == true);
+
+    /* Without a cached AP every attempt scans */
+    setup(&ls, &fake, 0);
+    link_supervisor_set_cached_ap(&ls, false);
+    send(&ls, LINK_EVENT_DISCONNECTED, 1000);
+    run_to_deadline(&ls, 1000);
+    CHECK(fake.connects == 1);
+    CHECK(fake.cached[0] == false);
+}
+
+/* Outage time runs from the link going down to the IP coming back */
+static void test_outage_stats(void)
+{
+    static const uint32_t outages_ms[] = { 3000, 1000, 8000 };
+    link_supervisor_t ls;
+    fake_platform_t fake;
+    uint32_t now_ms = 10000;
+
+    setup(&ls, &fake, 0);
+    for (size_t i = 0; i < sizeof(outages_ms) / sizeof(outages_ms[0]); i++)
+    {
+        uint32_t down_ms = now_ms;
+        send(&ls, LINK_EVENT_DISCONNECTED, down_ms);
+        run_to_deadline(&ls, down_ms);
+        send(&ls, LINK_EVENT_CONNECTED, down_ms + outages_ms[i] - 100);
+        send(&ls, LINK_EVENT_GOT_IP, down_ms + outages_ms[i]);
+        CHECK(ls.state == LINK_STATE_UP);
+        CHECK(ls.stats.last_ms == outages_ms[i]);
+        now_ms = down_ms + outages_ms[i] + 60000;
+    }
+    CHECK(ls.stats.reconnects == 3);
+    CHECK(ls.stats.min_ms == 1000);
+    CHECK(ls.stats.max_ms == 8000);
+    CHECK(ls.stats.total_ms == 12000);
+    CHECK(ls.stats.total_ms / ls.stats.reconnects == 4000);
+    CHECK(fake.downs == 3);
+    CHECK(fake.ups == 3);
+    /* mDNS announces on its own when the address comes back */
+    CHECK(fake.announces == 0);
+    CHECK(ls.stats.reannounces == 0);
+
+    /* The driver reconnecting on its own between attempts also counts */
+    send(&ls, LINK_EVENT_DISCONNECTED, now_ms);
+    send(&ls, LINK_EVENT_CONNECTED, now_ms + 100);
+    send(&ls, LINK_EVENT_GOT_IP, now_ms + 300);
+    CHECK(ls.stats.reconnects == 4);
+    CHECK(ls.stats.last_ms == 300);
+    CHECK(ls.stats.min_ms == 300);
+}
+
+/* Re-announce after the silence window, doubling up to the cap, reset by a controller */
+static void test_reannounce_timing(void)
+{
+    link_supervisor_t ls;
+    fake_platform_t fake;
+    uint32_t now_ms = 1000;
+    uint32_t interval_ms = test_config.mdns_silence_ms;
+
+    setup(&ls, &fake, 0);
+
+    /* Nothing to wait for until a controller has been seen */
+    CHECK(link_supervisor_next_timeout(&ls, now_ms) == UINT32_MAX);
+    send(&ls, LINK_EVENT_TICK, now_ms + 10 * test_config.mdns_silence_ms);
+    CHECK(fake.announces == 0);
+
+    send(&ls, LINK_EVENT_CONTROLLER_CONNECTED, now_ms);
+    CHECK(link_supervisor_next_timeout(&ls, now_ms) == UINT32_MAX);
+    now_ms += 5000;
+    send(&ls, LINK_EVENT_CONTROLLER_DISCONNECTED, now_ms);
+    CHECK(link_supervisor_next_timeout(&ls, now_ms) == test_config.mdns_silence_ms);
+
+    send(&ls, LINK_EVENT_TICK, now_ms + test_config.mdns_silence_ms - 1);
+    CHECK(fake.announces == 0);
+
+    for (int announce = 1; announce <= 5; announce++)
+    {
+        CHECK(link_supervisor_next_timeout(&ls, now_ms) == interval_ms);
+        now_ms = run_to_deadline(&ls, now_ms);
+        CHECK(fake.announces == announce);
+        interval_ms = (interval_ms * 2 > test_config.mdns_silence_max_ms) ? test_config.mdns_silence_max_ms : interval_ms * 2;
+    }
+    CHECK(ls.stats.reannounces == 5);
+    CHECK(link_supervisor_next_timeout(&ls, now_ms) == test_config.mdns_silence_max_ms);
+
+    /* No re-announce while a controller holds a session */
+    send(&ls, LINK_EVENT_CONTROLLER_CONNECTED, now_ms);
+    CHECK(link_supervisor_next_timeout(&ls, now_ms) == UINT32_MAX);
+    send(&ls, LINK_EVENT_TICK, now_ms + 2 * test_config.mdns_silence_max_ms);
+    CHECK(fake.announces == 5);
+
+    /* A controller coming back starts the window over */
+    now_ms += 1000;
+    send(&ls, LINK_EVENT_CONTROLLER_DISCONNECTED, now_ms);
+    CHECK(link_supervisor_next_timeout(&ls, now_ms) == test_config.mdns_silence_ms);
+
+    /* No re-announce while the link is down */
+    send(&ls, LINK_EVENT_DISCONNECTED, now_ms + 1000);
+    send(&ls, LINK_EVENT_TICK, now_ms + 1000 + test_config.mdns_silence_ms);
+    CHECK(fake.announces == 5);
+}
+
+int main(void)
+{
+    test_backoff_bounds(false);
+    test_backoff_bounds(true);
+    test_connect_timeout();
+    test_lost_ip_during_attempt();
+    test_cached_ap_fallback();
+    test_outage_stats();
+    test_reannounce_timing();
+
+    if (failures)
+    {
+        printf("link supervisor: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("link supervisor: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2020 <Mark Buckaway> MIT License
+ *
+ * Host test for the valve command coalescing and anti-chatter state machine. Feeds it
+ * scripted valve commands the way the actuation task in sprinkler.c does on the device.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "valve_transition.h"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define MS(ms) ((int64_t)(ms) * 1000)
+
+static const valve_transition_config_t test_config = {
+    .settle_us = MS(500),
+    .min_dwell_us = MS(2000),
+};
+
+/* Run the state machine, returning true if the relay switched, and the added latency */
+static bool run(valve_transition_t *vt, const valve_transition_config_t *config, int64_t now_us, int64_t *latency_us)
+{
+    *latency_us = -1;
+    return valve_transition_run(vt, config, now_us, latency_us);
+}
+
+/* A single command switches the relay at first_request_us + settle_us */
+static void test_settle_window(void)
+{
+    valve_transition_t vt;
+    int64_t latency_us;
+
+    valve_transition_init(&vt, 0);
+    CHECK(valve_transition_due_us(&vt, &test_config) == INT64_MAX);
+    CHECK(!run(&vt, &test_config, MS(1000), &latency_us));
+
+    CHECK(valve_transition_request(&vt, 1, MS(1000)));
+    CHECK(vt.relay == 0);
+    CHECK(vt.target == 1);
+    CHECK(valve_transition_due_us(&vt, &test_config) == MS(1500));
+
+    CHECK(!run(&vt, &test_config, MS(1500) - 1, &latency_us));
+    CHECK(vt.relay == 0);
+    CHECK(run(&vt, &test_config, MS(1500), &latency_us));
+    CHECK(vt.relay == 1);
+    CHECK(latency_us == MS(500));
+    CHECK(vt.last_change_us == MS(1500));
+    CHECK(valve_transition_due_us(&vt, &test_config) == INT64_MAX);
+
+    /* Running late still only switches once, and reports the real latency */
+    valve_transition_init(&vt, 0);
+    valve_transition_request(&vt, 1, MS(1000));
+    CHECK(run(&vt, &test_config, MS(1730), &latency_us));
+    CHECK(latency_us == MS(730));
+    CHECK(!run(&vt, &test_config, MS(1800), &latency_us));
+}
+
+/* Commands within the window coalesce into one net transition, or none */
+static void test_burst(void)
+{
+    valve_transition_t vt;
+    int64_t latency_us;
+
+    /* On then off cancels out */
+    valve_transition_init(&vt, 0);
+    CHECK(valve_transition_request(&vt, 1, MS(1000)));
+    CHECK(valve_transition_request(&vt, 0, MS(1100)));
+    CHECK(valve_transition_due_us(&vt, &test_config) == MS(1500));
+    CHECK(!run(&vt, &test_config, MS(1500), &latency_us));
+    CHECK(vt.relay == 0);
+    CHECK(!vt.pending);
+    CHECK(valve_transition_due_us(&vt, &test_config) == INT64_MAX);
+    /* A cancelled burst does not start the dwell time */
+    CHECK(valve_transition_request(&vt, 1, MS(1600)));
+    CHECK(valve_transition_due_us(&vt, &test_config) == MS(2100));
+
+    /* On, off, on is one transition timed from the first command */
+    valve_transition_init(&vt, 0);
+    valve_transition_request(&vt, 1, MS(1000));
+    valve_transition_request(&vt, 0, MS(1100));
+    valve_transition_request(&vt, 1, MS(1400));
+    CHECK(valve_transition_due_us(&vt, &test_config) == MS(1500));
+    CHECK(run(&vt, &test_config, MS(1500), &latency_us));
+    CHECK(vt.relay == 1);
+    CHECK(latency_us == MS(500));
+
+    /* Repeating the current target is not a new transition */
+    valve_transition_init(&vt, 1);
+    CHECK(!valve_transition_request(&vt, 1, MS(1000)));
+    CHECK(!run(&vt, &test_config, MS(1500), &latency_us));
+    CHECK(vt.relay == 1);
+}
+
+/* A relay that just switched holds its state for the minimum dwell time */
+static void test_dwell(void)
+{
+    valve_transition_t vt;
+    int64_t latency_us;
+
+    valve_transition_init(&vt, 0);
+    valve_transition_request(&vt, 1, MS(1000));
+    CHECK(run(&vt, &test_config, MS(1500), &latency_us));
+
+    /* Dwell ends at 3500, after the settle window of the new command */
+    CHECK(valve_transition_request(&vt, 0, MS(1600)));
+    CHECK(valve_transition_due_us(&vt, &test_config) == MS(3500));
+    CHECK(!run(&vt, &test_config, MS(2100), &latency_us));
+    CHECK(!run(&vt, &test_config, MS(3500) - 1, &latency_us));
+    CHECK(vt.relay == 1);
+    CHECK(run(&vt, &test_config, MS(3500), &latency_us));
+    CHECK(vt.relay == 0);
+    CHECK(latency_us == MS(1900));
+
+    /* A command back to the relay state is not held up by the dwell time */
+    valve_transition_request(&vt, 1, MS(3600));
+    valve_transition_request(&vt, 0, MS(3700));
+    CHECK(valve_transition_due_us(&vt, &test_config) == MS(4100));
+    CHECK(!run(&vt, &test_config, MS(4100), &latency_us));
+    CHECK(!vt.pending);
+
+    /* Once the dwell time has passed only the settle window applies */
+    valve_transition_request(&vt, 1, MS(10000));
+    CHECK(valve_transition_due_us(&vt, &test_config) == MS(10500));
+
+    /* With no settle window the relay switches as soon as the dwell time allows */
+    const valve_transition_config_t no_settle = {
+        .settle_us = 0,
+        .min_dwell_us = MS(2000),
+    };
+    valve_transition_init(&vt, 0);
+    valve_transition_request(&vt, 1, MS(1000));
+    CHECK(run(&vt, &no_settle, MS(1000), &latency_us));
+    CHECK(latency_us == 0);
+    valve_transition_request(&vt, 0, MS(1200));
+    CHECK(valve_transition_due_us(&vt, &no_settle) == MS(3000));
+}
+
+/* The failsafe switches straight away, whatever the settle window and dwell time */
+static void test_force(void)
+{
+    valve_transition_t vt;
+    int64_t latency_us;
+
+    valve_transition_init(&vt, 0);
+    valve_transition_request(&vt, 1, MS(1000));
+    CHECK(run(&vt, &test_config, MS(1500), &latency_us));
+
+    /* Inside the dwell time, with a command pending */
+    valve_transition_request(&vt, 1, MS(1600));
+    CHECK(valve_transition_force(&vt, 0, MS(1610)));
+    CHECK(vt.relay == 0);
+    CHECK(vt.target == 0);
+    CHECK(!vt.pending);
+    CHECK(vt.last_change_us == MS(1610));
+    CHECK(valve_transition_due_us(&vt, &test_config) == INT64_MAX);
+    CHECK(!run(&vt, &test_config, MS(5000), &latency_us));
+
+    /* Already in that state, nothing to switch */
+    CHECK(!valve_transition_force(&vt, 0, MS(1700)));
+    CHECK(vt.last_change_us == MS(1610));
+
+    /* The forced transition starts the dwell time like any other */
+    valve_transition_request(&vt, 1, MS(1700));
+    CHECK(valve_transition_due_us(&vt, &test_config) == MS(3610));
+}
+
+int main(void)
+{
+    test_settle_window();
+    test_burst();
+    test_dwell();
+    test_force();
+
+    if (failures)
+    {
+        printf("valve transition: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("valve transition: all checks passed\n");
+    return 0;
+}